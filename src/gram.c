@@ -12,10 +12,23 @@
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <time.h>
 #include <ctype.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <limits.h>
+#include <math.h>
 
 /* FLAGS:
 ECHO: Echo mode echos all characters back to terminal
@@ -32,9 +45,39 @@ OPOST: Disables output processing
 #define KILO_VERSION "1.0"
 #define KILO_TAB_STOP 8
 #define KILO_QUIT_TIMES 2
+#define KILO_SAVE_CHUNK (1024 * 1024) // Bytes written per call by the save thread
+#define KILO_INPLACE_MIN (64 * 1024 * 1024) // Files this large only rewrite their changed tail
+#define KILO_JOURNAL_MS 200 // Interval between group commits of the recovery journal
+#define KILO_JOURNAL_MAGIC "GRAMJRN1"
+#define KILO_FOLLOW_TAIL (1024 * 1024) // Bytes of a followed file shown when it is opened
+#define KILO_FOLLOW_MAXROWS 200000 // Oldest rows are dropped past this many in follow mode
+#define KILO_FOLLOW_BUDGET (64 * 1024 * 1024) // Bytes read from a followed file between redraws
+#define KILO_RESYNC_WINDOW 64 // Lines searched ahead to resynchronise a reload diff
+#define KILO_FIRST_SCREEN (64 * 1024) // Bytes of a file read before the editor first draws
+#define KILO_STREAM_AHEAD (8 * 1024 * 1024) // Bytes the reader thread may get ahead of the rows
+#define KILO_IO_DEPTH 8 // Chunks of KILO_SAVE_CHUNK bytes kept in flight when loading or saving
+#define KILO_IO_THREADS 4 // Threads doing the i/o when io_uring isn't available
+#define KILO_HASH_BASE 0x9e3779b97f4a7c15ULL // Odd, so it has an inverse mod 2^64
+#define KILO_HEX_WIDTH 16 // Bytes per line in the hex view
+#define KILO_BINARY_PCT 10 // Percentage of control bytes that makes a file binary
+#define KILO_CSV_SAMPLE 2000 // Rows measured to pick column widths in CSV/TSV files
+#define KILO_CSV_MAXWIDTH 40 // Widest a CSV/TSV column is drawn, longer fields are cut short
+#define KILO_DIFF_COST 4096 // Edit distance at which the diff stops looking for the shortest script
+#define KILO_UNDO_MAX (32 * 1024 * 1024) // Bytes of undo history kept, the oldest changes are dropped past this
+#define KILO_UNDO_MAGIC "GRAMUND1"
+#define KILO_UNDO_FILE_MAX (256 * 1024 * 1024) // Undo files that grow past this start over
+#define KILO_CURSORS_MAX 100000 // Most cursors a search places
+#define KILO_KILL_RING 16 // Copies and cuts kept for pasting
+#define KILO_LINE_THREADS 8 // Most threads a line operation is split over
+#define KILO_LINE_MIN 16384 // Rows below which a line operation stays on one thread
+#define KILO_JUMPS 100 // Positions kept in the jump list
 
 #define CTRL_KEY(k) ((k) & 0x1f)
 
+// Word-at-a-time byte tests: every byte set to 0x01, and every byte's high bit
+#define SWAR_ONES 0x0101010101010101ULL
+#define SWAR_HIGHS 0x8080808080808080ULL
+
 enum editorKey {
   BACKSPACE = 127,
   ARROW_LEFT = 1000,
@@ -45,7 +88,9 @@ enum editorKey {
   HOME_KEY,
   END_KEY,
   PAGE_UP,
-  PAGE_DOWN
+  PAGE_DOWN,
+  CTRL_ARROW_LEFT,
+  CTRL_ARROW_RIGHT
 };
 
 enum editorHighlight {
@@ -59,6 +104,14 @@ enum editorHighlight {
   HL_MATCH
 };
 
+// Encodings a file can be read and written in, rows always hold UTF-8
+enum editorEncoding {
+  ENC_UTF8 = 0,
+  ENC_UTF16LE,
+  ENC_UTF16BE,
+  ENC_LATIN1
+};
+
 #define HL_HIGHLIGHT_NUMBERS (1<<0)
 #define HL_HIGHLIGHT_STRINGS (1<<1)
 
@@ -73,9 +126,18 @@ struct editorSyntax {
   char *multiline_comment_start; // Pattern for start and end of multi-line comments
   char *multiline_comment_end;
   int flags; // Contains flags for whether to highlight numbers or strings for filetype
+  char delim; // Field separator for tabular files, 0 for everything else
 };
 
 // Data type for storing a row of text
+// Row text the kill ring refers to instead of copying it. The row and each kill ring
+// entry holding it count as a reference, and the row takes its own copy before changing it
+struct sharedText {
+  int refs;
+  char *chars;
+  int len;
+};
+
 typedef struct erow {
   int idx; // Index within file of row
   int size;
@@ -86,8 +148,542 @@ typedef struct erow {
   unsigned char *hl;
   // Store whether prev line is part of unenclosed ml comment
   int hl_open_comment;
+  // Offset of the row (and its newline) in the file on disk, -1 if it has changed since
+  off_t off;
+  off_t save_off; // Offset the row is given by the save in progress
+  uint64_t hash; // Hash of chars, kept up to date by editorUpdateRow
+  // Index in chars where each field starts in a CSV/TSV file, followed by size + 1.
+  // Built the first time it is needed, nfields is -1 until then
+  int *fields;
+  int nfields;
+  struct sharedText *share; // Set while the kill ring refers to chars
+  int pending; // Changed during the edit in progress, rebuilt when it commits
 } erow;
 
+enum ioOp {
+  IO_READ = 1,
+  IO_WRITE
+};
+
+// Read or write queued for the thread pool
+struct ioRequest {
+  int op;
+  int fd;
+  char *buf;
+  size_t len;
+  off_t off;
+  void *data;
+};
+
+// Finished request, res is the byte count or -errno
+struct ioCompletion {
+  void *data;
+  ssize_t res;
+};
+
+// Queue of reads and writes, run by io_uring or by a pool of threads
+struct ioQueue {
+  int uring;
+  int depth;
+  int inflight; // Submitted and not yet reaped
+  int notify; // eventfd that becomes readable when there are completions to reap
+  // io_uring rings, shared with the kernel
+  int ring;
+  void *sq_map, *cq_map;
+  size_t sq_size, cq_size, sqe_size;
+  unsigned *sq_tail, *sq_array, sq_mask;
+  unsigned *cq_head, *cq_tail, cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  unsigned pending; // Filled in but not yet handed to the kernel
+  // Thread pool
+  pthread_t threads[KILO_IO_THREADS];
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_cond_t donecond;
+  struct ioRequest *todo;
+  int ntodo;
+  struct ioCompletion *done;
+  int ndone;
+  int stop;
+};
+
+// Piece of a file being loaded, chunks can arrive in any order
+struct loadChunk {
+  char *buf;
+  off_t off;
+  size_t len;
+  size_t got;
+  int ready;
+};
+
+// Part of a buffer being written
+struct ioSpan {
+  char *buf;
+  size_t len;
+  off_t off;
+};
+
+// Edit operations recorded in the recovery journal
+enum journalOp {
+  J_INSERT_ROW = 1,
+  J_DEL_ROW,
+  J_INSERT, // len bytes of text at at
+  J_APPEND,
+  J_DEL_CHAR,
+  J_TRUNCATE,
+  J_DELETE, // Text is the bytes removed from at
+  J_INSERT_ROWS, // Text is newline terminated lines
+  J_DEL_ROWS // at is the number of rows
+};
+
+// Fixed part of a journal record, followed by len bytes of text
+struct journalRecord {
+  uint8_t op;
+  uint32_t row;
+  uint32_t at;
+  uint32_t len;
+} __attribute__((packed));
+
+// Start of the journal file, identifies the version of the file the records apply to
+struct journalHeader {
+  char magic[8];
+  uint64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  uint64_t ino;
+};
+
+// Append-only log of edits since the last save, written by a background thread
+struct editorJournal {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int running;
+  int stop;
+  int fd;
+  char *path;
+  int replaying; // Don't record edits made while replaying the journal itself
+  // Records not yet handed to the thread
+  char *buf;
+  size_t len;
+  size_t cap;
+  long long total; // Bytes of records appended since the journal was created
+  // Owned by the thread: logical position of the first record in the file
+  long long file_start;
+  long long file_end;
+  // Save request: drop records before reset and rewrite the header from base
+  long long reset;
+  struct journalHeader base;
+};
+
+// Kinds of change kept for undo, the text of either can span rows
+enum undoOp {
+  U_INSERT = 1,
+  U_DELETE
+};
+
+// One change: text inserted or deleted at row, at, with '\n' standing for
+// the end of a row, so splitting a row is an insert of "\n" and joining two
+// a delete of it
+struct undoRecord {
+  int op;
+  int group; // Records of one keypress are undone together
+  int typed; // Made by typing or backspacing, the next keystroke may extend it
+  int row, at;
+  int cy, cx; // Cursor before the change
+  char *text;
+  size_t len;
+  int mapped; // Text points into the undo file of an earlier session
+};
+
+// Kinds of frame in an undo file, which replayed in order rebuild the history
+enum undoFrameKind {
+  UF_PUSH = 1, // New record, its text follows
+  UF_APPEND, // Text added to the end of the last record
+  UF_PREPEND, // Text added in front of the last record, which now starts at row, at
+  UF_UNDO,
+  UF_REDO
+};
+
+struct undoFrame {
+  uint8_t kind;
+  uint8_t op;
+  int32_t group;
+  int32_t row, at;
+  int32_t cy, cx;
+  uint32_t len;
+} __attribute__((packed));
+
+// Start of an undo file, rewritten on each save to say where the saved history ends
+struct undoHeader {
+  char magic[8];
+  uint64_t hash; // Document hash of the file as saved
+  int64_t rows;
+  int64_t end; // Frames past this were made after the last save and are dropped on reopen
+  int64_t group; // Highest group up to end, later sessions number theirs after it
+};
+
+// Undo history, records before cur can be undone and the rest redone
+struct editorUndo {
+  struct undoRecord *rec;
+  int n;
+  int cap;
+  int cur;
+  size_t bytes; // Memory held by the records
+  int group; // Group of the keypress being handled
+  int typing; // Keypress being handled is typing or backspacing a character
+  int suspend; // A larger change is being built from smaller ones, which aren't recorded
+  // History kept on disk across sessions
+  int fd;
+  char *path;
+  off_t end; // Bytes of frames written
+  char *map; // Frames of earlier sessions, only read when an undo reaches back into them
+  size_t maplen;
+  int indexed;
+  // Frames held back while many changes are made at once, then written in one go
+  int hold;
+  char *pend;
+  size_t plen, pcap;
+};
+
+struct cursorPos {
+  int cy, cx;
+};
+
+// Several cursors editing at once. pos holds all of them sorted by position, with
+// E.cx and E.cy standing for the one at primary. n is 0 while there is only one
+struct editorCursors {
+  struct cursorPos *pos;
+  int n;
+  int cap;
+  int primary;
+};
+
+// Change made at one cursor: del bytes from row, col on, the end of a row
+// counting as one byte, then ins put in their place
+struct cursorEdit {
+  int row, col;
+  int del;
+  const char *ins;
+  int inslen;
+};
+
+// Copied or cut text, held as references to the rows it came from. It starts at col
+// of the first row and ends at endcol of the last, rows is NULL for the empty line
+// past the end of the file
+struct killEntry {
+  struct sharedText **rows;
+  int n;
+  int col, endcol;
+  size_t len; // Bytes, with a newline between rows
+};
+
+struct editorKill {
+  struct killEntry ring[KILO_KILL_RING];
+  int n;
+  int head; // Slot the next entry goes in
+  // Entries back from the newest the last key pasted, -1 unless it did, and where it went
+  int yank;
+  int yrow, ycol;
+  size_t ylen;
+};
+
+// Text between the cursor and where the selection was started
+struct editorSelection {
+  int active;
+  int cy, cx;
+};
+
+// Rows hidden under a folded line, start is the row right after it. Nodes form a treap
+// keyed on start, shift is still to be added to every range below a node
+struct foldNode {
+  int start, end;
+  int shift;
+  int hidden; // Rows hidden by the node and everything below it
+  unsigned prio;
+  struct foldNode *left, *right;
+};
+
+struct editorFolds {
+  struct foldNode *root;
+  unsigned seed;
+};
+
+// A position that moves with its line as rows are inserted and deleted above it. Nodes
+// form a treap keyed on row, shift is still to be added to every mark below a node
+struct markNode {
+  int row, col;
+  int shift;
+  unsigned prio;
+  struct markNode *left, *right, *parent;
+};
+
+// Edit in progress, see editorBeginEdit
+struct editorEdit {
+  int depth; // editorBeginEdit calls not yet committed
+  int *rows; // Rows changed since they were last rebuilt
+  int n, cap;
+};
+
+struct statCount {
+  long long bytes, words;
+};
+
+// One node per row in file order, a treap keyed on position. Sums over each subtree
+// make totals for the buffer or any run of rows O(log n), and rows are inserted and
+// deleted by position in O(log n) too
+struct statNode {
+  struct statCount own, sum; // Bytes and words of the row, and of its whole subtree
+  int rows;
+  unsigned prio;
+  struct statNode *left, *right;
+};
+
+struct editorStats {
+  struct statNode *root;
+  unsigned seed;
+};
+
+enum markKind {
+  MARK_NAMED = 0,
+  MARK_BOOK,
+  MARK_JUMP,
+  MARK_KINDS
+};
+
+struct editorMarks {
+  struct markNode *root[MARK_KINDS]; // Each kind in its own tree
+  struct markNode *named[26]; // Marks a to z
+  struct markNode *jumps[KILO_JUMPS]; // Oldest first
+  int njumps;
+  int jump; // Entry the last jump back or forward went to, njumps when there was none
+  unsigned seed;
+};
+
+// How sort orders lines: field is 1-based and 0 for the whole line
+struct sortSpec {
+  int numeric;
+  int reverse;
+  int field;
+};
+
+// Sort key of one row, pointing into its chars
+struct sortKey {
+  const char *s;
+  int len;
+  double num;
+  int row; // Offset from the start of the range
+};
+
+// Line transforms, see editorTransformLine
+enum transformOp {
+  T_INDENT = 1,
+  T_OUTDENT,
+  T_EXPAND,
+  T_UNEXPAND,
+  T_TRIM,
+  T_UPPER,
+  T_LOWER
+};
+
+// Slice of a bulk transform: new chars, rendering and hash of rows from..to-1 of the range,
+// out is NULL for rows the transform leaves alone
+struct transformJob {
+  pthread_t thread;
+  int op;
+  int base;
+  int from, to;
+  char **out;
+  int *outlen;
+  char **render;
+  int *rsize;
+  uint64_t *hash;
+  int threaded;
+};
+
+// Part of a parallel sort: fill and sort keys n keys, or merge a[0..na) with a[na..n) into out
+struct sortJob {
+  pthread_t thread;
+  struct sortKey *a, *tmp, *out;
+  size_t n, na;
+  int merge;
+  int base; // First row of the range
+  int first; // Offset in the range of the rows a sort job keys
+  struct sortSpec *sp;
+};
+
+// Incomplete last line of streamed text, kept until its newline arrives
+struct lineSplitter {
+  char *partial;
+  size_t plen;
+  size_t pcap;
+  off_t off; // File offset of partial, -1 when the text doesn't come from the open file
+  int enc; // Encoding of the input, converted to UTF-8 before it is split
+  unsigned char carry[4]; // End of a character that continues in the next input
+  int ncarry;
+  char *dec; // Converted input
+  size_t deccap;
+};
+
+// Growing file being watched in follow mode
+struct editorFollow {
+  int active;
+  int fd;
+  int ifd; // inotify instance
+  int wd;
+  off_t pos; // Bytes of the file consumed so far
+  int behind; // Stopped at the budget with more of the file left to read
+  struct lineSplitter lines;
+};
+
+// Pipe or other non-regular input read by a background thread
+struct editorStream {
+  int active;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int fd;
+  char *name; // What to call the source in messages
+  // Bytes read by the thread and not yet turned into rows
+  char *buf;
+  size_t len;
+  size_t cap;
+  int eof;
+  int err;
+  size_t total;
+  off_t size; // Expected size when loading a file, 0 for pipes
+  int loading; // Loading the open file, which can't be edited until it's complete
+  struct timespec shown; // Last time progress was drawn
+  struct lineSplitter lines;
+  // Regular files keep several reads in flight on io instead of reading on the thread
+  int async;
+  struct ioQueue io;
+  struct loadChunk chunk[KILO_IO_DEPTH];
+  off_t next; // Next offset to ask for
+  off_t appended; // Everything before this offset has been turned into rows
+};
+
+// Watch on the directory of the open file so writes by other programs are noticed
+struct editorWatch {
+  int ifd;
+  int wd;
+  char *name; // Basename of the file within the watched directory
+  int pending; // Events arrived that haven't been checked yet
+  int conflict; // File changed on disk while we had unsaved changes
+};
+
+// Binary file paged straight from an mmap, without any rows
+struct editorHex {
+  int active;
+  unsigned char *map;
+  size_t size;
+  size_t top; // Offset of the first byte on screen, a multiple of KILO_HEX_WIDTH
+  size_t cur; // Offset of the byte under the cursor
+  // Last search pattern, so Ctrl-F can continue from the next match
+  unsigned char *pat;
+  size_t patlen;
+};
+
+// Column layout of a CSV/TSV file, widths come from a sample of rows
+struct editorCsv {
+  char delim; // 0 when the file isn't tabular
+  int header; // Keep the first row on screen while scrolling
+  int stale; // Widths need sampling again
+  int ncols;
+  int *width;
+  int *start; // Screen column where each column begins, ncols + 1 entries
+  // Aligned copy of the row being drawn and its highlighting
+  char *line;
+  unsigned char *hl;
+  int linecap;
+};
+
+// Line of a file being compared, it points into the file's mapping
+struct diffLine {
+  const char *s;
+  int len;
+  int id; // Equal lines get equal ids, on either side
+  uint64_t hash;
+};
+
+struct diffSide {
+  const char *name;
+  char *map;
+  size_t size;
+  struct diffLine *lines;
+  int n;
+};
+
+// Row of the diff view, a or b is -1 where that side has no line
+struct diffPair {
+  int a, b;
+  int changed;
+};
+
+// Working state of the Myers diff, fd and bd point at the middle of their arrays so
+// they can be indexed by negative diagonals
+struct diffSeq {
+  int *a, *b;
+  char *achg, *bchg;
+  int *fd, *bd;
+};
+
+// Two files side by side, scrolled together. E.cy and E.rowoff count pairs
+struct editorDiff {
+  int active;
+  struct diffSide a, b;
+  struct diffPair *pairs;
+  int npairs;
+  int *hunks; // First pair of each run of changes
+  int nhunks;
+};
+
+// Running from a script with no terminal. Keys pressed by the script come from keys
+struct editorBatch {
+  int active;
+  const char *keys;
+  size_t nkeys;
+  size_t pos;
+};
+
+// Run of the saved file, copied from src in the original or taken from the snapshot if src is -1
+struct saveExtent {
+  off_t src;
+  size_t len;
+};
+
+// State shared between the editor and the background save thread
+struct editorSaveJob {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  int active; // Thread is running or waiting to be joined
+  int done; // Set by the thread when it has finished
+  int err; // errno of the failed step, 0 on success
+  char *path; // File to replace
+  mode_t mode; // Permissions for the new file
+  char *buf; // Snapshot of the document taken when the save started
+  size_t len;
+  size_t written; // Progress of the thread through buf
+  int shown; // Last progress percentage shown in the status bar
+  int dirty; // Value of E.dirty at the time of the snapshot
+  // In-place saves write buf at offset of the existing file instead of replacing it
+  int inplace;
+  off_t offset;
+  int mod_row, mod_col; // Modified position the snapshot started from
+  off_t undo_end; // Undo file length and step at the time of the snapshot
+  int undo_group;
+  // Full saves copy rows unchanged since the last read or write straight from the original
+  int srcfd;
+  struct saveExtent *ext;
+  int numext;
+  size_t copied; // Bytes copied from the original rather than written from buf
+  long long journal_mark; // Journal position of the snapshot
+  uint64_t hash; // Document hash of the snapshot
+  int rows;
+  struct ioQueue io;
+};
+
 // Struct to contain editor state
 struct editorConfig {
   // Cursor x and y position
@@ -102,10 +698,42 @@ struct editorConfig {
   erow *row;
   // Dirty variable, dirty if been modified since opening or saving file
   int dirty;
+  // Lowest row and column modified since the file was last saved or opened
+  int mod_row, mod_col;
   char *filename;
+  // File as it was when it was last read or written, to check in-place saves are safe
+  struct stat disk;
+  int disk_valid;
+  int crlf; // Line endings were stripped on load so memory and disk offsets differ
+  int encoding; // How the file is stored, see editorEncoding
+  int bom; // Length of the byte order mark the file starts with, 0 if none
+  // Sum of row hash * KILO_HASH_BASE^row, updated as rows change, move, come and go
+  uint64_t doc_hash;
+  uint64_t saved_hash; // doc_hash of the contents on disk
+  int saved_rows;
+  int saved_valid;
   char statusmsg[80];
   time_t statusmsg_time;
   struct editorSyntax *syntax;
+  struct editorSaveJob save;
+  struct editorJournal journal;
+  struct editorFollow follow;
+  struct editorStream stream;
+  struct editorWatch watch;
+  struct editorHex hex;
+  struct editorCsv csv;
+  struct editorDiff diff;
+  struct editorBatch batch;
+  struct editorUndo undo;
+  struct editorCursors cursors;
+  struct editorKill kill;
+  struct editorSelection sel;
+  struct editorFolds folds;
+  struct editorMarks marks;
+  struct editorStats stats;
+  struct editorEdit edit;
+  int readonly; // Buffer mirrors something we must not write back
+  int busy; // Background work is waiting, don't block in read()
   // Original terminal attributes
   struct termios orig_termios;
 };
@@ -124,6 +752,10 @@ char *C_HL_keywords[] = {
   "void|", NULL
 };
 
+char *CSV_HL_extensions[] = { ".csv", NULL };
+char *TSV_HL_extensions[] = { ".tsv", ".tab", NULL };
+char *TAB_HL_keywords[] = { NULL };
+
 // Highlight database
 struct editorSyntax HLDB[] = {
   {
@@ -131,7 +763,24 @@ struct editorSyntax HLDB[] = {
     C_HL_extensions,
     C_HL_keywords,
     "//", "/*", "*/",
-    HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+    HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+    0
+  },
+  {
+    "csv",
+    CSV_HL_extensions,
+    TAB_HL_keywords,
+    NULL, NULL, NULL,
+    HL_HIGHLIGHT_NUMBERS,
+    ','
+  },
+  {
+    "tsv",
+    TSV_HL_extensions,
+    TAB_HL_keywords,
+    NULL, NULL, NULL,
+    HL_HIGHLIGHT_NUMBERS,
+    '\t'
   },
 };
 // Length of HLDB array
@@ -142,14 +791,44 @@ struct editorSyntax HLDB[] = {
 void editorSetStatusMessage(const char *fmt, ...);
 void editorRefreshScreen();
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
+int editorIdle();
+int editorConfirm(const char *fmt, ...);
+void editorJournalReset(long long mark);
+void editorJournalStart();
+int editorDiskUnchanged(char *path, struct stat *st);
+void editorWatchStart();
+void editorJournalRecover();
+void editorStreamOpen(int fd, const char *name, off_t size);
+void editorLoadComplete();
+void editorMarkSaved(uint64_t hash);
+void editorAppendText(struct lineSplitter *ls, char *buf, size_t len);
+void editorFlushText(struct lineSplitter *ls);
+void editorJournalRecord(int op, int row, int at, const char *s, size_t len);
+void editorUndoAdd(int op, int row, int at, char *text, size_t len);
+void editorUndoSaved(off_t end, int group, uint64_t hash, int rows);
+void editorUndoStart();
+void editorUndoOpen();
+void editorUndoWrite(int kind, struct undoRecord *r, const char *text, size_t len);
+void editorUndoIndex();
+int editorIsBinary(const unsigned char *buf, size_t len);
+int editorCsvCxToRx(erow *row, int cx);
+char *editorRowsText(int at, int n, size_t *len);
+int editorCanEdit();
+void editorMoveCursor(int key);
+void editorUpdateRow(erow *row);
+void editorUndoBegin();
+void editorHexOpen(int fd);
+void initEditor();
 
 /*** terminal ***/
 
 // Prints error message and exits program
 void die(const char *s) {
-  // Clear screen
-  write(STDOUT_FILENO, "\x1b[2J", 4);
-  write(STDOUT_FILENO, "\x1b[H", 3);
+  // Clear screen, unless there is no screen
+  if (!E.batch.active) {
+    write(STDOUT_FILENO, "\x1b[2J", 4);
+    write(STDOUT_FILENO, "\x1b[H", 3);
+  }
   // Print error message
   perror(s);
   exit(1);
@@ -184,27 +863,68 @@ void enableRawMode() {
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetattr");;
 }
 
+// Next byte of input, from the terminal or from a batch script's keys
+int editorReadByte(char *c) {
+  if (E.batch.active) {
+    if (E.batch.pos >= E.batch.nkeys) return 0;
+    *c = E.batch.keys[E.batch.pos++];
+    return 1;
+  }
+  return read(STDIN_FILENO, c, 1);
+}
+
 // Waits for key press, then return it
 int editorReadKey() {
   int nread;
   char c;
-  while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
+  if (E.batch.active) {
+    // Scripts that run out of keys in a prompt cancel it
+    if (editorReadByte(&c) != 1) return '\x1b';
+  }
+  while (!E.batch.active) {
+    // While a load is streaming in, check for a key without sitting in the read timeout
+    if (E.stream.active) {
+      // Wake up as soon as a read completes, not just on a key or the timeout
+      struct pollfd pfd[2] = { { STDIN_FILENO, POLLIN, 0 }, { E.stream.async ? E.stream.io.notify : -1, POLLIN, 0 } };
+      poll(pfd, 2, E.busy ? 0 : 10);
+      if (!(pfd[0].revents & POLLIN)) {
+        if (editorIdle()) editorRefreshScreen();
+        continue;
+      }
+    }
+    if ((nread = read(STDIN_FILENO, &c, 1)) == 1) break;
     if (nread ==-1 && errno != EAGAIN) die ("read");
+    // Read timed out, give background work a chance to report
+    if (editorIdle()) editorRefreshScreen();
   }
 
   if (c == '\x1b') {
-    char seq[3];
+    char seq[5];
 
-    if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-    if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
+    if (editorReadByte(&seq[0]) != 1) return '\x1b';
+    if (editorReadByte(&seq[1]) != 1) return '\x1b';
 
     // Check to see if escape sequence is arrow key or page key, then return corresponding character
     if (seq[0] == '[') {
       if (seq[1] >= '0' && seq[1] <= '9') {
-        if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
+        if (editorReadByte(&seq[2]) != 1) return '\x1b';
+        // Arrows with a modifier, like \x1b[1;5C for Ctrl-Right
+        if (seq[2] == ';') {
+          if (editorReadByte(&seq[3]) != 1) return '\x1b';
+          if (editorReadByte(&seq[4]) != 1) return '\x1b';
+          int ctrl = (seq[3] == '5');
+          switch (seq[4]) {
+            case 'A': return ARROW_UP;
+            case 'B': return ARROW_DOWN;
+            case 'C': return ctrl ? CTRL_ARROW_RIGHT : ARROW_RIGHT;
+            case 'D': return ctrl ? CTRL_ARROW_LEFT : ARROW_LEFT;
+          }
+          return '\x1b';
+        }
         if (seq[2] == '~') {
           switch (seq[1]) {
             case '1': return HOME_KEY;
+            case '3': return DEL_KEY;
             case '4': return END_KEY;
             case '5': return PAGE_UP;
             case '6': return PAGE_DOWN;
@@ -430,6 +1150,7 @@ int editorSyntaxToColor(int hl) {
 
 void editorSelectSyntaxHighlight() {
   E.syntax = NULL;
+  E.csv.delim = 0;
   if (E.filename == NULL) return;
   // Find last occurrence of . characrer to get extension part of filename
   char *ext = strrchr(E.filename, '.');
@@ -445,6 +1166,8 @@ void editorSelectSyntaxHighlight() {
       if ((is_ext && ext && !strcmp(ext, s->filematch[i])) || (!is_ext && strstr(E.filename, s->filematch[j]))) {
         // Set E.syntax to current editorSyntax struct
         E.syntax = s;
+        E.csv.delim = s->delim;
+        E.csv.stale = 1;
 
         // Rehighlight entire file
         int filerow;
@@ -459,381 +1182,5775 @@ void editorSelectSyntaxHighlight() {
   }
 }
 
-/*** row operations ***/
+/*** folding ***/
 
-int editorRowCxToRx(erow *row, int cx) {
-  int rx = 0;
-  int j;
-  for (j = 0; j < cx; j++) {
-    if (row->chars[j] == '\t') {
-      rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
-    }
-    rx++;
-  }
-  return rx;
+// Random priority for a treap node, xorshift is enough to keep the trees balanced
+unsigned editorTreapPriority(unsigned *seed) {
+  unsigned x = *seed;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *seed = x;
 }
 
-int editorRowRxToCx(erow *row, int rx) {
-  int cur_rx = 0;
-  int cx;
-  for (cx = 0; cx < row->size; cx++) { // Loop through chars string
-    if (row->chars[cx] == '\t')
-      cur_rx += (KILO_TAB_STOP - 1) - (cur_rx % KILO_TAB_STOP); // Calculate current rx value
-    cur_rx++;
+// Move a subtree's ranges by delta rows without visiting it
+void editorFoldShift(struct foldNode *t, int delta) {
+  if (t == NULL) return;
+  t->start += delta;
+  t->end += delta;
+  t->shift += delta;
+}
 
-    // Stop when current rx hits given rx value
-    if (cur_rx > rx) return cx;
-  }
-  return cx;
+// Hand a node's pending shift on to its children
+void editorFoldPush(struct foldNode *t) {
+  if (t->shift == 0) return;
+  editorFoldShift(t->left, t->shift);
+  editorFoldShift(t->right, t->shift);
+  t->shift = 0;
 }
 
-void editorUpdateRow(erow *row) {
-  int tabs = 0;
-  int j;
-  for (j = 0; j < row->size; j++){
-    if (row->chars[j] == '\t') tabs++;
-  }
+int editorFoldHidden(struct foldNode *t) {
+  return t ? t->hidden : 0;
+}
 
-  free(row->render);
-  row->render = malloc(row->size + tabs*(KILO_TAB_STOP - 1) + 1);
+void editorFoldPull(struct foldNode *t) {
+  t->hidden = t->end - t->start + 1 + editorFoldHidden(t->left) + editorFoldHidden(t->right);
+}
 
-  int idx = 0;
-  for (j = 0; j < row->size; j++) {
-    if (row->chars[j] == '\t') {
-      row->render[idx++] = ' ';
-      while (idx % KILO_TAB_STOP != 0) row->render[idx++] = ' ';
-    } else {
-      row->render[idx++] = row->chars[j];
-    }
+// Split t into the ranges starting before row and the rest
+void editorFoldSplit(struct foldNode *t, int row, struct foldNode **a, struct foldNode **b) {
+  if (t == NULL) {
+    *a = *b = NULL;
+    return;
   }
-  row->render[idx] = '\0';
-  row->rsize = idx;
+  editorFoldPush(t);
+  if (t->start < row) {
+    editorFoldSplit(t->right, row, &t->right, b);
+    *a = t;
+  } else {
+    editorFoldSplit(t->left, row, a, &t->left);
+    *b = t;
+  }
+  editorFoldPull(t);
+}
 
-  editorUpdateSyntax(row);
+// Join two treaps, every range in a before every range in b
+struct foldNode *editorFoldMerge(struct foldNode *a, struct foldNode *b) {
+  if (a == NULL) return b;
+  if (b == NULL) return a;
+  if (a->prio > b->prio) {
+    editorFoldPush(a);
+    a->right = editorFoldMerge(a->right, b);
+    editorFoldPull(a);
+    return a;
+  }
+  editorFoldPush(b);
+  b->left = editorFoldMerge(a, b->left);
+  editorFoldPull(b);
+  return b;
 }
 
+struct foldNode *editorFoldNode(int start, int end) {
+  struct foldNode *t = malloc(sizeof(*t));
+  t->start = start;
+  t->end = end;
+  t->shift = 0;
+  t->hidden = end - start + 1;
+  t->prio = editorTreapPriority(&E.folds.seed);
+  t->left = t->right = NULL;
+  return t;
+}
 
-void editorInsertRow(int at, char *s, size_t len) {
-  if (at < 0 ||at > E.numrows) return;
+void editorFoldFree(struct foldNode *t) {
+  if (t == NULL) return;
+  editorFoldFree(t->left);
+  editorFoldFree(t->right);
+  free(t);
+}
 
-  E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-  memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
-  // Update index of each row that was displaced
-  for (int j = at + 1; j <= E.numrows; j++) E.row[j].idx++;
+void editorFoldClear() {
+  editorFoldFree(E.folds.root);
+  E.folds.root = NULL;
+}
 
-  E.row[at].idx = at; // Row's index in file at time of insert
+// Hidden range row is in, NULL if the row is shown
+struct foldNode *editorFoldFind(int row) {
+  struct foldNode *t = E.folds.root;
+  while (t) {
+    editorFoldPush(t);
+    if (row < t->start) t = t->left;
+    else if (row > t->end) t = t->right;
+    else return t;
+  }
+  return NULL;
+}
 
-  E.row[at].size = len;
-  E.row[at].chars = malloc(len + 1);
-  memcpy(E.row[at].chars, s, len);
-  E.row[at].chars[len] = '\0';
+// Number of shown rows before a file row
+int editorFoldRowToVisible(int row) {
+  int hidden = 0;
+  struct foldNode *t = E.folds.root;
+  while (t) {
+    editorFoldPush(t);
+    if (row <= t->start) {
+      t = t->left;
+      continue;
+    }
+    hidden += editorFoldHidden(t->left);
+    if (row <= t->end) {
+      hidden += row - t->start;
+      break;
+    }
+    hidden += t->end - t->start + 1;
+    t = t->right;
+  }
+  return row - hidden;
+}
 
-  E.row[at].rsize = 0;
-  E.row[at].render = NULL;
-  E.row[at].hl = NULL;
-  E.row[at].hl_open_comment = 0;
-  editorUpdateRow(&E.row[at]);
+// File row of the v-th shown row, the inverse of editorFoldRowToVisible
+int editorFoldVisibleToRow(int v) {
+  int hidden = 0;
+  struct foldNode *t = E.folds.root;
+  while (t) {
+    editorFoldPush(t);
+    // Rows shown before this range
+    int shown = t->start - hidden - editorFoldHidden(t->left);
+    if (v < shown) {
+      t = t->left;
+    } else {
+      hidden += editorFoldHidden(t->left) + t->end - t->start + 1;
+      t = t->right;
+    }
+  }
+  return v + hidden;
+}
 
-  E.numrows++;
-  E.dirty++; // Change dirty flag
+// Row to land on when moving onto a hidden row, the line it is folded under or the one after
+int editorFoldSkip(int row, int dir) {
+  struct foldNode *f = editorFoldFind(row);
+  if (f == NULL) return row;
+  return dir < 0 ? f->start - 1 : f->end + 1;
 }
 
-void editorFreeRow(erow *row) {
-  free(row->render);
-  free(row->chars);
-  free(row->hl);
+// Replace node f, the last range starting before at, by its new end
+void editorFoldResize(struct foldNode **a, struct foldNode *f, int end) {
+  struct foldNode *m;
+  editorFoldSplit(*a, f->start, a, &m);
+  m->end = end;
+  editorFoldPull(m);
+  *a = editorFoldMerge(*a, m);
 }
 
-void editorDelRow(int at) {
-  if (at < 0 || at >= E.numrows) return;
-  editorFreeRow(&E.row[at]);
-  memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-  // Update index of each row that was displaced
-  for (int j = at; j < E.numrows - 1; j++) E.row[j].idx--;
-  E.numrows--;
-  E.dirty++;
+// n rows were inserted at at: ranges after them move down, one they landed inside grows
+void editorFoldInsert(int at, int n) {
+  if (E.folds.root == NULL) return;
+  struct foldNode *f = editorFoldFind(at), *a, *b;
+  editorFoldSplit(E.folds.root, at, &a, &b);
+  editorFoldShift(b, n);
+  if (f && f->start < at) editorFoldResize(&a, f, f->end + n);
+  E.folds.root = editorFoldMerge(a, b);
 }
 
-void editorRowInsertChar(erow *row, int at, int c) {
-  // Validate at which is index to insert char into
-  if (at < 0 || at > row->size) at = row->size;
-  row->chars = realloc (row->chars, row->size + 2);
-  memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-  row->size++;
-  row->chars[at] = c;
-  editorUpdateRow(row);
-  E.dirty++;
+// n rows were deleted from at on: ranges that lost their folded line go, one the rows
+// were cut out of shrinks and ranges after move up
+void editorFoldDelete(int at, int n) {
+  if (E.folds.root == NULL) return;
+  struct foldNode *f = editorFoldFind(at), *a, *m, *b;
+  int shrink = f && f->start < at;
+  editorFoldSplit(E.folds.root, at, &a, &m);
+  editorFoldSplit(m, at + n + 1, &m, &b);
+  editorFoldFree(m);
+  editorFoldShift(b, -n);
+  if (shrink) editorFoldResize(&a, f, f->end >= at + n ? f->end - n : at - 1);
+  E.folds.root = editorFoldMerge(a, b);
 }
 
-void editorRowAppendString(erow *row, char *s, size_t len) {
-  row->chars = realloc(row->chars, row->size + len + 1);
-  memcpy(&row->chars[row->size], s, len);
-  row->size += len;
-  row->chars[row->size] = '\0';
-  editorUpdateRow(row);
-  E.dirty++;
+// Rows at..at+n-1 were put in a new order of m rows. A range can't follow lines that
+// no longer sit together, so folds in the rows or under one of them open and ranges
+// after move up by the rows dropped. Returns 1 if any fold opened
+int editorFoldReorder(int at, int n, int m) {
+  if (E.folds.root == NULL) return 0;
+  struct foldNode *f = editorFoldFind(at), *a, *mid, *b;
+  editorFoldSplit(E.folds.root, f ? f->start : at, &a, &mid);
+  editorFoldSplit(mid, at + n + 1, &mid, &b);
+  editorFoldShift(b, m - n);
+  E.folds.root = editorFoldMerge(a, b);
+  editorFoldFree(mid);
+  return mid != NULL;
 }
 
-void editorRowDelChar(erow *row, int at) {
-  if (at < 0 || at >= row->size) return;
-  memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-  row->size--;
-  editorUpdateRow(row);
-  E.dirty++;
+// Hide rows start to end, taking in any folds already inside them
+void editorFoldAdd(int start, int end) {
+  if (start > end || editorFoldFind(start - 1)) return;
+  struct foldNode *a, *m, *b;
+  editorFoldSplit(E.folds.root, start, &a, &m);
+  editorFoldSplit(m, end + 1, &m, &b);
+  for (struct foldNode *t = m; t; t = t->right) {
+    editorFoldPush(t);
+    if (t->right == NULL && t->end > end) end = t->end;
+  }
+  editorFoldFree(m);
+  E.folds.root = editorFoldMerge(editorFoldMerge(a, editorFoldNode(start, end)), b);
 }
 
-/*** editor operations ***/
+void editorFoldRemove(struct foldNode *f) {
+  struct foldNode *a, *m, *b;
+  editorFoldSplit(E.folds.root, f->start, &a, &m);
+  editorFoldSplit(m, f->start + 1, &m, &b);
+  editorFoldFree(m);
+  E.folds.root = editorFoldMerge(a, b);
+}
 
-void editorInsertChar(int c) {
-  // Check if need to append new row before inserting character
-  if (E.cy == E.numrows) {
-    editorInsertRow(E.numrows, "", 0);
+// Columns a row is indented by, -1 if it is blank
+int editorFoldIndent(erow *row) {
+  int w = 0;
+  for (int j = 0; j < row->size; j++) {
+    if (row->chars[j] == ' ') w++;
+    else if (row->chars[j] == '\t') w += KILO_TAB_STOP - w % KILO_TAB_STOP;
+    else return w;
   }
-  editorRowInsertChar(&E.row[E.cy], E.cx, c);
-  E.cx++;
+  return -1;
 }
 
-void editorInsertNewline() {
-  // If at beginning of line, insert new blank row before
-  if (E.cx == 0) {
-    editorInsertRow(E.cy, "", 0);
-  } else { // Otherwise, split line into two rows
-    erow *row = &E.row[E.cy];
-    // Call editorInsertRow and pass characters to the right of cursor
-    editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-    // Reassign row pointer as editorInsertRow() calls realloc which could move mem around
-    row = &E.row[E.cy];
-    // Truncate current row contents by setting size to position of cursor
-    row->size = E.cx;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
-  }
-  // Move cursor to beginning of next line
-  E.cy++;
-  E.cx = 0;
+// Whether render position j of a row is code rather than a string or comment
+int editorFoldIsCode(erow *row, int j) {
+  return row->hl == NULL || (row->hl[j] != HL_STRING && row->hl[j] != HL_COMMENT && row->hl[j] != HL_MLCOMMENT);
 }
 
-void editorDelChar() {
-  // Check if cursor is past end of file or at the beginning of first line
-  if (E.cy == E.numrows) return;
-  if (E.cx == 0 && E.cy == 0) return;
+// Last row of the block under row at, at itself if there is none. A line leaving a
+// brace open runs to the line before the one closing it, anything else to the last
+// line indented deeper than it
+int editorFoldBlock(int at) {
+  erow *row = &E.row[at];
+  int depth = 0;
+  for (int j = 0; j < row->rsize; j++) {
+    if (!editorFoldIsCode(row, j)) continue;
+    if (row->render[j] == '{') depth++;
+    else if (row->render[j] == '}' && depth > 0) depth--;
+  }
+  if (depth > 0) {
+    for (int r = at + 1; r < E.numrows; r++) {
+      row = &E.row[r];
+      for (int j = 0; j < row->rsize; j++) {
+        if (!editorFoldIsCode(row, j)) continue;
+        if (row->render[j] == '{') depth++;
+        else if (row->render[j] == '}' && --depth == 0) return r - 1;
+      }
+    }
+    return E.numrows - 1;
+  }
 
-  // Get row cursor is on, if character to the left delete it
-  erow *row = &E.row[E.cy];
-  if (E.cx > 0) {
-    editorRowDelChar(row, E.cx - 1);
-    // Move cursor after deleting
-    E.cx--;
-  } else {
-    E.cx = E.row[E.cy - 1].size;
-    editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-    editorDelRow(E.cy);
-    E.cy--;
+  int indent = editorFoldIndent(row), last = at;
+  if (indent == -1) return at;
+  for (int r = at + 1; r < E.numrows; r++) {
+    int w = editorFoldIndent(&E.row[r]);
+    if (w == -1) continue;
+    if (w <= indent) break;
+    last = r;
   }
+  return last;
 }
 
-/*** file i/o ***/
-
-char *editorRowsToString(int *buflen) {
-  int totlen = 0;
-  int j;
-  // Add up lenghts of each row of text
-  for (j = 0; j < E.numrows; j++) {
-    totlen += E.row[j].size + 1; // Add one for the newline character
+// Nearest row above at whose block takes in at, -1 if there is none
+int editorFoldEnclosing(int at) {
+  int best = -1;
+  // The line leaving open the brace at is inside of
+  int depth = 0;
+  for (int r = at - 1; r >= 0 && best == -1; r--) {
+    erow *row = &E.row[r];
+    for (int j = row->rsize - 1; j >= 0; j--) {
+      if (!editorFoldIsCode(row, j)) continue;
+      if (row->render[j] == '}') {
+        depth++;
+      } else if (row->render[j] == '{' && depth-- == 0) {
+        if (editorFoldBlock(r) >= at) best = r;
+        break;
+      }
+    }
+    if (depth < 0) break;
   }
-  // Save total length into buflen to allocate memory
-  *buflen = totlen;
+  // The line at is indented under, if it is nearer
+  int indent = at < E.numrows ? editorFoldIndent(&E.row[at]) : -1;
+  for (int r = at - 1; r > best && indent != 0; r--) {
+    int w = editorFoldIndent(&E.row[r]);
+    if (w != -1 && (indent == -1 || w < indent)) {
+      if (editorFoldBlock(r) >= at) best = r;
+      break;
+    }
+  }
+  return best;
+}
+
+// Fold the block under the cursor line, or the one the cursor is in, or open the
+// fold the cursor line already has
+void editorFoldToggle() {
+  if (E.cy >= E.numrows) return;
+  struct foldNode *f = editorFoldFind(E.cy + 1);
+  if (f) {
+    editorSetStatusMessage("Unfolded %d lines", f->end - f->start + 1);
+    editorFoldRemove(f);
+    return;
+  }
+  int at = E.cy, last = editorFoldBlock(at);
+  if (last == at) {
+    at = editorFoldEnclosing(E.cy);
+    if (at == -1) {
+      editorSetStatusMessage("Nothing to fold here");
+      return;
+    }
+    last = editorFoldBlock(at);
+  }
+  editorFoldAdd(at + 1, last);
+  if (E.cy != at) {
+    E.cy = at;
+    if (E.cx > E.row[at].size) E.cx = E.row[at].size;
+  }
+  editorSetStatusMessage("Folded %d lines", last - at);
+}
+
+// Fold every outermost block in one pass over the file
+void editorFoldAll() {
+  editorFoldClear();
+  int folds = 0;
+  for (int r = 0; r < E.numrows;) {
+    int last = editorFoldBlock(r);
+    if (last > r) {
+      // Ranges come in order, so each joins along the right edge
+      E.folds.root = editorFoldMerge(E.folds.root, editorFoldNode(r + 1, last));
+      folds++;
+      r = last + 1;
+    } else {
+      r++;
+    }
+  }
+  // The cursor goes to the line its row is folded under
+  struct foldNode *f = editorFoldFind(E.cy);
+  if (f) {
+    E.cy = f->start - 1;
+    if (E.cx > E.row[E.cy].size) E.cx = E.row[E.cy].size;
+  }
+  editorSetStatusMessage("%d folds, %d lines hidden", folds, editorFoldHidden(E.folds.root));
+}
+
+/*** buffer statistics ***/
+
+// Words in s, runs of anything but whitespace
+int editorCountWords(const char *s, int len) {
+  int words = 0, in = 0;
+  for (int j = 0; j < len; j++) {
+    int space = isspace((unsigned char)s[j]);
+    if (!space && !in) words++;
+    in = !space;
+  }
+  return words;
+}
+
+void editorStatsPull(struct statNode *t) {
+  t->sum = t->own;
+  t->rows = 1;
+  struct statNode *kids[2] = { t->left, t->right };
+  for (int k = 0; k < 2; k++) {
+    if (kids[k] == NULL) continue;
+    t->sum.bytes += kids[k]->sum.bytes;
+    t->sum.words += kids[k]->sum.words;
+    t->rows += kids[k]->rows;
+  }
+}
+
+int editorStatsRows(struct statNode *t) {
+  return t ? t->rows : 0;
+}
+
+// Split t into its first n rows and the rest
+void editorStatsSplit(struct statNode *t, int n, struct statNode **a, struct statNode **b) {
+  if (t == NULL) {
+    *a = *b = NULL;
+    return;
+  }
+  int l = editorStatsRows(t->left);
+  if (n <= l) {
+    editorStatsSplit(t->left, n, a, &t->left);
+    *b = t;
+  } else {
+    editorStatsSplit(t->right, n - l - 1, &t->right, b);
+    *a = t;
+  }
+  editorStatsPull(t);
+}
+
+struct statNode *editorStatsMerge(struct statNode *a, struct statNode *b) {
+  if (a == NULL) return b;
+  if (b == NULL) return a;
+  if (a->prio > b->prio) {
+    a->right = editorStatsMerge(a->right, b);
+    editorStatsPull(a);
+    return a;
+  }
+  b->left = editorStatsMerge(a, b->left);
+  editorStatsPull(b);
+  return b;
+}
+
+void editorStatsFree(struct statNode *t) {
+  if (t == NULL) return;
+  editorStatsFree(t->left);
+  editorStatsFree(t->right);
+  free(t);
+}
+
+// n rows were inserted at at, they count nothing until their chars are rendered
+void editorStatsInsert(int at, int n) {
+  struct statNode *m = NULL, *a, *b;
+  for (int k = 0; k < n; k++) {
+    struct statNode *t = calloc(1, sizeof(*t));
+    t->rows = 1;
+    t->prio = editorTreapPriority(&E.stats.seed);
+    m = editorStatsMerge(m, t);
+  }
+  editorStatsSplit(E.stats.root, at, &a, &b);
+  E.stats.root = editorStatsMerge(editorStatsMerge(a, m), b);
+}
+
+void editorStatsDelete(int at, int n) {
+  struct statNode *a, *m, *b;
+  editorStatsSplit(E.stats.root, at, &a, &m);
+  editorStatsSplit(m, n, &m, &b);
+  editorStatsFree(m);
+  E.stats.root = editorStatsMerge(a, b);
+}
+
+// Give row n of t new counts, fixing the sums on the way back up
+void editorStatsSet(struct statNode *t, int n, struct statCount c) {
+  int l = editorStatsRows(t->left);
+  if (n < l) editorStatsSet(t->left, n, c);
+  else if (n > l) editorStatsSet(t->right, n - l - 1, c);
+  else t->own = c;
+  editorStatsPull(t);
+}
+
+// Row's chars changed, count them again
+void editorStatsUpdate(erow *row) {
+  if (row->idx >= editorStatsRows(E.stats.root)) return;
+  struct statCount c = { row->size + 1, editorCountWords(row->chars, row->size) };
+  editorStatsSet(E.stats.root, row->idx, c);
+}
+
+// Bytes and words in the first n rows, newlines included
+struct statCount editorStatsPrefix(int n) {
+  struct statCount c = { 0, 0 };
+  struct statNode *t = E.stats.root;
+  while (t && n > 0) {
+    int l = editorStatsRows(t->left);
+    if (n <= l) {
+      t = t->left;
+      continue;
+    }
+    if (t->left) {
+      c.bytes += t->left->sum.bytes;
+      c.words += t->left->sum.words;
+    }
+    c.bytes += t->own.bytes;
+    c.words += t->own.words;
+    n -= l + 1;
+    t = t->right;
+  }
+  return c;
+}
+
+// Bytes and words from row sr, col sc up to row er, col ec
+struct statCount editorStatsRange(int sr, int sc, int er, int ec) {
+  struct statCount c = { 0, 0 };
+  if (sr == er) {
+    if (sr < E.numrows) {
+      c.bytes = ec - sc;
+      c.words = editorCountWords(&E.row[sr].chars[sc], ec - sc);
+    }
+    return c;
+  }
+  erow *row = &E.row[sr];
+  c.bytes = row->size - sc + 1;
+  c.words = editorCountWords(&row->chars[sc], row->size - sc);
+  struct statCount a = editorStatsPrefix(sr + 1), b = editorStatsPrefix(er);
+  c.bytes += b.bytes - a.bytes;
+  c.words += b.words - a.words;
+  if (er < E.numrows) {
+    c.bytes += ec;
+    c.words += editorCountWords(E.row[er].chars, ec);
+  }
+  return c;
+}
+
+/*** marks ***/
+
+void editorMarkShift(struct markNode *t, int delta) {
+  if (t == NULL) return;
+  t->row += delta;
+  t->shift += delta;
+}
+
+void editorMarkPush(struct markNode *t) {
+  if (t->shift == 0) return;
+  editorMarkShift(t->left, t->shift);
+  editorMarkShift(t->right, t->shift);
+  t->shift = 0;
+}
+
+// Point a node's children back at it
+void editorMarkLink(struct markNode *t) {
+  if (t->left) t->left->parent = t;
+  if (t->right) t->right->parent = t;
+}
+
+// Split t into the marks before row and the rest
+void editorMarkSplit(struct markNode *t, int row, struct markNode **a, struct markNode **b) {
+  if (t == NULL) {
+    *a = *b = NULL;
+    return;
+  }
+  editorMarkPush(t);
+  if (t->row < row) {
+    editorMarkSplit(t->right, row, &t->right, b);
+    *a = t;
+  } else {
+    editorMarkSplit(t->left, row, a, &t->left);
+    *b = t;
+  }
+  editorMarkLink(t);
+}
+
+struct markNode *editorMarkMerge(struct markNode *a, struct markNode *b) {
+  if (a == NULL) return b;
+  if (b == NULL) return a;
+  if (a->prio > b->prio) {
+    editorMarkPush(a);
+    a->right = editorMarkMerge(a->right, b);
+    editorMarkLink(a);
+    return a;
+  }
+  editorMarkPush(b);
+  b->left = editorMarkMerge(a, b->left);
+  editorMarkLink(b);
+  return b;
+}
+
+void editorMarkSetRoot(int kind, struct markNode *t) {
+  E.marks.root[kind] = t;
+  if (t) t->parent = NULL;
+}
+
+// Row a mark is on, its own row plus the shifts still held by the nodes above it
+int editorMarkRow(struct markNode *t) {
+  int row = t->row;
+  for (struct markNode *p = t->parent; p; p = p->parent) row += p->shift;
+  return row;
+}
+
+struct markNode *editorMarkAdd(int kind, int row, int col) {
+  struct markNode *t = malloc(sizeof(*t)), *a, *b;
+  t->row = row;
+  t->col = col;
+  t->shift = 0;
+  t->prio = editorTreapPriority(&E.marks.seed);
+  t->left = t->right = t->parent = NULL;
+  editorMarkSplit(E.marks.root[kind], row, &a, &b);
+  editorMarkSetRoot(kind, editorMarkMerge(editorMarkMerge(a, t), b));
+  return t;
+}
+
+void editorMarkRemove(int kind, struct markNode *t) {
+  editorMarkPush(t);
+  struct markNode *m = editorMarkMerge(t->left, t->right), *p = t->parent;
+  if (p == NULL) {
+    editorMarkSetRoot(kind, m);
+  } else {
+    if (p->left == t) p->left = m;
+    else p->right = m;
+    if (m) m->parent = p;
+  }
+  free(t);
+}
+
+void editorMarkFree(struct markNode *t) {
+  if (t == NULL) return;
+  editorMarkFree(t->left);
+  editorMarkFree(t->right);
+  free(t);
+}
+
+// Forget every mark, bookmark and jump, for when the rows are another file's
+void editorMarkClear() {
+  for (int k = 0; k < MARK_KINDS; k++) {
+    editorMarkFree(E.marks.root[k]);
+    E.marks.root[k] = NULL;
+  }
+  memset(E.marks.named, 0, sizeof(E.marks.named));
+  E.marks.njumps = 0;
+  E.marks.jump = 0;
+}
+
+// n rows were inserted at at, marks from there on move down with their lines
+void editorMarkInsert(int at, int n) {
+  for (int k = 0; k < MARK_KINDS; k++) {
+    if (E.marks.root[k] == NULL) continue;
+    struct markNode *a, *b;
+    editorMarkSplit(E.marks.root[k], at, &a, &b);
+    editorMarkShift(b, n);
+    editorMarkSetRoot(k, editorMarkMerge(a, b));
+  }
+}
+
+void editorMarkCollapse(struct markNode *t, int row) {
+  if (t == NULL) return;
+  t->row = row;
+  t->shift = 0;
+  editorMarkCollapse(t->left, row);
+  editorMarkCollapse(t->right, row);
+}
+
+// n rows were deleted from at on: marks on them go to the line that took their place,
+// marks after move up
+void editorMarkDelete(int at, int n) {
+  for (int k = 0; k < MARK_KINDS; k++) {
+    if (E.marks.root[k] == NULL) continue;
+    struct markNode *a, *m, *b;
+    editorMarkSplit(E.marks.root[k], at, &a, &m);
+    editorMarkSplit(m, at + n, &m, &b);
+    editorMarkCollapse(m, at);
+    editorMarkShift(b, -n);
+    editorMarkSetRoot(k, editorMarkMerge(a, editorMarkMerge(m, b)));
+  }
+}
+
+// Take every mark below t out of its tree and add it to *into on the row its line went to,
+// to[] giving the new offset from at of the row at at+j
+void editorMarkMove(struct markNode *t, int at, const int *to, struct markNode **into) {
+  if (t == NULL) return;
+  editorMarkPush(t);
+  struct markNode *a, *b;
+  editorMarkMove(t->left, at, to, into);
+  editorMarkMove(t->right, at, to, into);
+  t->row = at + to[t->row - at];
+  t->left = t->right = t->parent = NULL;
+  editorMarkSplit(*into, t->row, &a, &b);
+  *into = editorMarkMerge(editorMarkMerge(a, t), b);
+}
+
+// Rows at..at+n-1 were put in a new order of m rows: marks on them follow their lines
+// as to[] says and marks after move up by the rows dropped
+void editorMarkReorder(int at, int n, const int *to, int m) {
+  for (int k = 0; k < MARK_KINDS; k++) {
+    if (E.marks.root[k] == NULL) continue;
+    struct markNode *a, *mid, *b, *moved = NULL;
+    editorMarkSplit(E.marks.root[k], at, &a, &mid);
+    editorMarkSplit(mid, at + n, &mid, &b);
+    editorMarkMove(mid, at, to, &moved);
+    editorMarkShift(b, m - n);
+    editorMarkSetRoot(k, editorMarkMerge(a, editorMarkMerge(moved, b)));
+  }
+}
+
+// Put the cursor on a mark, on the line it ended up on
+void editorMarkGo(struct markNode *t) {
+  E.cy = editorMarkRow(t);
+  if (E.cy > E.numrows) E.cy = E.numrows;
+  int size = E.cy < E.numrows ? E.row[E.cy].size : 0;
+  E.cx = t->col < size ? t->col : size;
+}
+
+// Remember a position before jumping away from it. Entries a jump back stepped over
+// are dropped, as is the oldest once the list is full
+void editorJumpPush(int row, int col) {
+  struct editorMarks *mk = &E.marks;
+  while (mk->njumps > mk->jump + 1) editorMarkRemove(MARK_JUMP, mk->jumps[--mk->njumps]);
+  if (mk->njumps && editorMarkRow(mk->jumps[mk->njumps - 1]) == row) {
+    mk->jumps[mk->njumps - 1]->col = col;
+    mk->jump = mk->njumps;
+    return;
+  }
+  if (mk->njumps == KILO_JUMPS) {
+    editorMarkRemove(MARK_JUMP, mk->jumps[0]);
+    memmove(&mk->jumps[0], &mk->jumps[1], sizeof(mk->jumps[0]) * --mk->njumps);
+  }
+  mk->jumps[mk->njumps++] = editorMarkAdd(MARK_JUMP, row, col);
+  mk->jump = mk->njumps;
+}
+
+void editorJumpBack() {
+  struct editorMarks *mk = &E.marks;
+  // Leaving the newest entry, so a jump forward can come back here
+  if (mk->njumps && mk->jump == mk->njumps) {
+    editorJumpPush(E.cy, E.cx);
+    mk->jump = mk->njumps - 1;
+  }
+  if (mk->jump == 0 || mk->njumps == 0) {
+    editorSetStatusMessage("No older jumps");
+    return;
+  }
+  editorMarkGo(mk->jumps[--mk->jump]);
+}
+
+void editorJumpForward() {
+  struct editorMarks *mk = &E.marks;
+  if (mk->jump >= mk->njumps - 1) {
+    editorSetStatusMessage("No newer jumps");
+    return;
+  }
+  editorMarkGo(mk->jumps[++mk->jump]);
+}
+
+// Set mark a to z at the cursor, moving it if it was already set
+void editorMarkSet(int name) {
+  struct markNode **m = &E.marks.named[name - 'a'];
+  if (*m) editorMarkRemove(MARK_NAMED, *m);
+  *m = editorMarkAdd(MARK_NAMED, E.cy, E.cx);
+  editorSetStatusMessage("Mark %c set", name);
+}
+
+void editorMarkJump(int name) {
+  struct markNode *m = E.marks.named[name - 'a'];
+  if (m == NULL) {
+    editorSetStatusMessage("Mark %c not set", name);
+    return;
+  }
+  editorJumpPush(E.cy, E.cx);
+  editorMarkGo(m);
+}
+
+// Bookmark on row, NULL if it has none
+struct markNode *editorBookmarkAt(int row) {
+  struct markNode *t = E.marks.root[MARK_BOOK];
+  while (t) {
+    editorMarkPush(t);
+    if (row == t->row) return t;
+    t = row < t->row ? t->left : t->right;
+  }
+  return NULL;
+}
+
+void editorBookmarkToggle() {
+  struct markNode *t = editorBookmarkAt(E.cy);
+  if (t) {
+    editorMarkRemove(MARK_BOOK, t);
+    editorSetStatusMessage("Bookmark removed");
+  } else {
+    editorMarkAdd(MARK_BOOK, E.cy, 0);
+    editorSetStatusMessage("Bookmark set");
+  }
+}
+
+// Go to the first bookmark below the cursor line, wrapping round to the top
+void editorBookmarkNext() {
+  struct markNode *t = E.marks.root[MARK_BOOK], *next = NULL;
+  if (t == NULL) {
+    editorSetStatusMessage("No bookmarks");
+    return;
+  }
+  while (t) {
+    editorMarkPush(t);
+    if (t->row > E.cy) {
+      next = t;
+      t = t->left;
+    } else {
+      t = t->right;
+    }
+  }
+  for (t = E.marks.root[MARK_BOOK]; next == NULL && t; t = t->left) {
+    editorMarkPush(t);
+    if (t->left == NULL) next = t;
+  }
+  editorJumpPush(E.cy, E.cx);
+  editorMarkGo(next);
+}
+
+/*** edit transactions ***/
+
+int editorRowIdxCmp(const void *a, const void *b) {
+  int x = *(const int *)a, y = *(const int *)b;
+  return (x > y) - (x < y);
+}
+
+// Rebuild every row changed so far, top to bottom so multi-line comments carry down
+void editorEditFlush() {
+  struct editorEdit *ed = &E.edit;
+  int sorted = 1;
+  for (int k = 1; k < ed->n && sorted; k++) sorted = ed->rows[k - 1] <= ed->rows[k];
+  if (!sorted) qsort(ed->rows, ed->n, sizeof(int), editorRowIdxCmp);
+  for (int k = 0; k < ed->n; k++) {
+    // Deleted before it was rebuilt
+    if (ed->rows[k] == -1) continue;
+    erow *row = &E.row[ed->rows[k]];
+    row->pending = 0;
+    editorUpdateRow(row);
+  }
+  ed->n = 0;
+}
+
+// Start an edit. Rows it changes are rendered and highlighted once, when the outermost
+// edit commits, and everything it does is one undo step
+void editorBeginEdit() {
+  if (E.edit.depth++ == 0) editorUndoBegin();
+}
+
+void editorCommitEdit() {
+  if (E.edit.depth > 0 && --E.edit.depth > 0) return;
+  editorEditFlush();
+}
+
+// Row's chars changed, rebuild it now or when the edit in progress commits
+void editorRowChanged(erow *row) {
+  struct editorEdit *ed = &E.edit;
+  if (ed->depth == 0) {
+    editorUpdateRow(row);
+    return;
+  }
+  if (row->pending) return;
+  row->pending = 1;
+  if (ed->n == ed->cap) {
+    ed->cap = ed->cap ? ed->cap * 2 : 64;
+    ed->rows = realloc(ed->rows, sizeof(int) * ed->cap);
+  }
+  ed->rows[ed->n++] = row->idx;
+}
+
+// Keep the rows waiting to be rebuilt pointing at the same lines as rows come and go
+void editorEditShift(int at, int delta) {
+  struct editorEdit *ed = &E.edit;
+  for (int k = 0; k < ed->n; k++) {
+    int r = ed->rows[k];
+    if (r == -1 || r < at) continue;
+    if (delta < 0 && r < at - delta) ed->rows[k] = -1;
+    else ed->rows[k] = r + delta;
+  }
+}
+
+// Rows were inserted or deleted, move folds, marks and statistics along with the lines
+void editorRowsInserted(int at, int n) {
+  editorFoldInsert(at, n);
+  editorMarkInsert(at, n);
+  editorEditShift(at, n);
+  editorStatsInsert(at, n);
+}
+
+void editorRowsDeleted(int at, int n) {
+  editorFoldDelete(at, n);
+  editorMarkDelete(at, n);
+  editorEditShift(at, -n);
+  editorStatsDelete(at, n);
+}
+
+/*** row operations ***/
+
+uint64_t editorHashPow(uint64_t b, uint64_t e) {
+  uint64_t r = 1;
+  while (e) {
+    if (e & 1) r *= b;
+    b *= b;
+    e >>= 1;
+  }
+  return r;
+}
+
+// Move rows from..to-1 by delta positions, keeping their idx and the document hash right
+void editorShiftRows(int from, int to, int delta) {
+  if (from >= to) return;
+  uint64_t sum = 0;
+  uint64_t pw = editorHashPow(KILO_HASH_BASE, E.row[from].idx);
+  for (int j = from; j < to; j++) {
+    sum += E.row[j].hash * pw;
+    pw *= KILO_HASH_BASE;
+    E.row[j].idx += delta;
+  }
+  // Multiply the moved rows' share of the hash by BASE^delta
+  uint64_t base = KILO_HASH_BASE;
+  if (delta < 0) {
+    // Inverse of an odd number mod 2^64 by Newton iteration
+    uint64_t inv = base;
+    for (int i = 0; i < 5; i++) inv *= 2 - base * inv;
+    base = inv;
+    delta = -delta;
+  }
+  E.doc_hash += sum * (editorHashPow(base, delta) - 1);
+}
+
+// Remove a row's share of the document hash before it goes away
+void editorUnhashRow(erow *row) {
+  E.doc_hash -= row->hash * editorHashPow(KILO_HASH_BASE, row->idx);
+}
+
+// 64-bit hash of a line, consumes eight bytes per step
+uint64_t editorHash(const char *s, size_t len) {
+  const uint64_t m = 0xff51afd7ed558ccdULL;
+  uint64_t h = 0x9e3779b97f4a7c15ULL ^ (len * m);
+  uint64_t k;
+  while (len >= 8) {
+    memcpy(&k, s, 8);
+    h ^= k * m;
+    h = ((h << 27) | (h >> 37)) * 0xc4ceb9fe1a85ec53ULL;
+    s += 8;
+    len -= 8;
+  }
+  k = 0;
+  memcpy(&k, s, len);
+  h ^= k * m;
+  // Final avalanche so short lines spread over all bits
+  h ^= h >> 33;
+  h *= m;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+int editorRowCxToRx(erow *row, int cx) {
+  int rx = 0;
+  int j;
+  for (j = 0; j < cx; j++) {
+    if (row->chars[j] == '\t') {
+      rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
+    }
+    rx++;
+  }
+  return rx;
+}
+
+int editorRowRxToCx(erow *row, int rx) {
+  int cur_rx = 0;
+  int cx;
+  for (cx = 0; cx < row->size; cx++) { // Loop through chars string
+    if (row->chars[cx] == '\t')
+      cur_rx += (KILO_TAB_STOP - 1) - (cur_rx % KILO_TAB_STOP); // Calculate current rx value
+    cur_rx++;
+
+    // Stop when current rx hits given rx value
+    if (cur_rx > rx) return cx;
+  }
+  return cx;
+}
+
+// Row text as drawn, with tabs expanded. Touches nothing else, so worker threads can call it
+char *editorRender(const char *chars, int size, int *rsize) {
+  int tabs = 0;
+  int j;
+  for (j = 0; j < size; j++){
+    if (chars[j] == '\t') tabs++;
+  }
+
+  char *render = malloc(size + tabs*(KILO_TAB_STOP - 1) + 1);
+
+  int idx = 0;
+  for (j = 0; j < size; j++) {
+    if (chars[j] == '\t') {
+      render[idx++] = ' ';
+      while (idx % KILO_TAB_STOP != 0) render[idx++] = ' ';
+    } else {
+      render[idx++] = chars[j];
+    }
+  }
+  render[idx] = '\0';
+  *rsize = idx;
+  return render;
+}
+
+// Give a row the rendering and hash of its new chars
+void editorSetRender(erow *row, char *render, int rsize, uint64_t hash) {
+  free(row->render);
+  row->render = render;
+  row->rsize = rsize;
+  // Field positions moved, rebuild them when next needed
+  free(row->fields);
+  row->fields = NULL;
+  row->nfields = -1;
+  E.doc_hash += (hash - row->hash) * editorHashPow(KILO_HASH_BASE, row->idx);
+  row->hash = hash;
+  editorStatsUpdate(row);
+}
+
+void editorUpdateRow(erow *row) {
+  int rsize;
+  char *render = editorRender(row->chars, row->size, &rsize);
+  editorSetRender(row, render, rsize, editorHash(row->chars, row->size));
+  editorUpdateSyntax(row);
+}
+
+// Remember the lowest position modified since the last save
+void editorMarkModified(int row, int col) {
+  // Row no longer matches what is on disk
+  if (row < E.numrows) {
+    E.row[row].off = -1;
+    E.row[row].save_off = -1;
+  }
+  if (row < E.mod_row || (row == E.mod_row && col < E.mod_col)) {
+    E.mod_row = row;
+    E.mod_col = col;
+  }
+}
+
+void editorInsertRow(int at, char *s, size_t len) {
+  if (at < 0 ||at > E.numrows) return;
+
+  E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
+  memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
+  // Update index of each row that was displaced
+  editorShiftRows(at + 1, E.numrows + 1, 1);
+  editorRowsInserted(at, 1);
+
+  E.row[at].idx = at; // Row's index in file at time of insert
+
+  E.row[at].size = len;
+  E.row[at].chars = malloc(len + 1);
+  memcpy(E.row[at].chars, s, len);
+  E.row[at].chars[len] = '\0';
+
+  E.row[at].rsize = 0;
+  E.row[at].render = NULL;
+  E.row[at].hl = NULL;
+  E.row[at].hl_open_comment = 0;
+  E.row[at].off = -1;
+  E.row[at].save_off = -1;
+  E.row[at].hash = 0;
+  E.row[at].fields = NULL;
+  E.row[at].nfields = -1;
+  E.row[at].share = NULL;
+  E.row[at].pending = 0;
+  editorRowChanged(&E.row[at]);
+
+  E.numrows++;
+  E.dirty++; // Change dirty flag
+  editorMarkModified(at, 0);
+  editorJournalRecord(J_INSERT_ROW, at, 0, s, len);
+  char *text = malloc(len + 1);
+  memcpy(text, s, len);
+  text[len] = '\n';
+  editorUndoAdd(U_INSERT, at, 0, text, len + 1);
+}
+
+// Insert the newline terminated lines in buf as rows starting at at, growing the
+// row array once. Used for text read from a file, so it doesn't count as an edit
+void editorInsertRows(int at, char *buf, size_t len) {
+  if (at < 0 || at > E.numrows) return;
+  int n = 0;
+  char *p = buf, *end = buf + len, *nl;
+  while (p < end && (nl = memchr(p, '\n', end - p)) != NULL) {
+    n++;
+    p = nl + 1;
+  }
+  if (n == 0) return;
+
+  E.row = realloc(E.row, sizeof(erow) * (E.numrows + n));
+  memmove(&E.row[at + n], &E.row[at], sizeof(erow) * (E.numrows - at));
+  editorShiftRows(at + n, E.numrows + n, n);
+  editorRowsInserted(at, n);
+
+  p = buf;
+  for (int j = at; j < at + n; j++) {
+    nl = memchr(p, '\n', end - p);
+    size_t linelen = nl - p;
+    if (linelen > 0 && p[linelen - 1] == '\r') linelen--;
+    erow *row = &E.row[j];
+    row->idx = j;
+    row->size = linelen;
+    row->chars = malloc(linelen + 1);
+    memcpy(row->chars, p, linelen);
+    row->chars[linelen] = '\0';
+    row->rsize = 0;
+    row->render = NULL;
+    row->hl = NULL;
+    row->hl_open_comment = 0;
+    row->off = -1;
+    row->save_off = -1;
+    row->hash = 0;
+    row->fields = NULL;
+    row->nfields = -1;
+    row->share = NULL;
+    row->pending = 0;
+    p = nl + 1;
+  }
+  E.numrows += n;
+  // Highlight in order so multi-line comments carry from one new row to the next
+  for (int j = at; j < at + n; j++) editorRowChanged(&E.row[j]);
+}
+
+// Give a row its own chars before they change, if the kill ring still refers to them
+void editorRowOwn(erow *row) {
+  struct sharedText *sh = row->share;
+  if (sh == NULL) return;
+  row->share = NULL;
+  if (--sh->refs == 0) {
+    free(sh);
+    return;
+  }
+  row->chars = malloc(row->size + 1);
+  memcpy(row->chars, sh->chars, row->size + 1);
+}
+
+// Let go of a row's chars, which stay around while the kill ring refers to them
+void editorRowRelease(erow *row) {
+  struct sharedText *sh = row->share;
+  row->share = NULL;
+  if (sh == NULL) {
+    free(row->chars);
+  } else if (--sh->refs == 0) {
+    free(sh->chars);
+    free(sh);
+  }
+  row->chars = NULL;
+}
+
+void editorFreeRow(erow *row) {
+  free(row->render);
+  editorRowRelease(row);
+  free(row->hl);
+  free(row->fields);
+}
+
+void editorDelRow(int at) {
+  if (at < 0 || at >= E.numrows) return;
+  editorMarkModified(at, 0);
+  editorJournalRecord(J_DEL_ROW, at, 0, NULL, 0);
+  editorRowOwn(&E.row[at]);
+  E.row[at].chars[E.row[at].size] = '\n';
+  editorUndoAdd(U_DELETE, at, 0, E.row[at].chars, E.row[at].size + 1);
+  E.row[at].chars = NULL;
+  editorUnhashRow(&E.row[at]);
+  editorFreeRow(&E.row[at]);
+  memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
+  // Update index of each row that was displaced
+  editorShiftRows(at, E.numrows - 1, -1);
+  editorRowsDeleted(at, 1);
+  E.numrows--;
+  E.dirty++;
+}
+
+// Remove n rows starting at at in one move, the counterpart of editorInsertRows
+void editorDelRows(int at, int n) {
+  if (at < 0 || n <= 0 || at >= E.numrows) return;
+  if (at + n > E.numrows) n = E.numrows - at;
+  for (int j = at; j < at + n; j++) {
+    editorUnhashRow(&E.row[j]);
+    editorFreeRow(&E.row[j]);
+  }
+  memmove(&E.row[at], &E.row[at + n], sizeof(erow) * (E.numrows - at - n));
+  E.numrows -= n;
+  editorShiftRows(at, E.numrows, -n);
+  editorRowsDeleted(at, n);
+  // Row before the gap may have closed a comment the removed rows continued
+  if (at < E.numrows) editorUpdateSyntax(&E.row[at]);
+}
+
+// Copy of len bytes of s for an undo record
+char *editorUndoText(const char *s, size_t len) {
+  char *text = malloc(len ? len : 1);
+  memcpy(text, s, len);
+  return text;
+}
+
+void editorRowInsertString(erow *row, int at, const char *s, size_t len) {
+  // Validate at which is index to insert into
+  if (at < 0 || at > row->size) at = row->size;
+  editorRowOwn(row);
+  row->chars = realloc(row->chars, row->size + len + 1);
+  memmove(&row->chars[at + len], &row->chars[at], row->size - at + 1);
+  memcpy(&row->chars[at], s, len);
+  row->size += len;
+  editorRowChanged(row);
+  E.dirty++;
+  editorMarkModified(row->idx, at);
+  editorJournalRecord(J_INSERT, row->idx, at, s, len);
+  editorUndoAdd(U_INSERT, row->idx, at, editorUndoText(s, len), len);
+}
+
+void editorRowInsertChar(erow *row, int at, int c) {
+  char ch = c;
+  editorRowInsertString(row, at, &ch, 1);
+}
+
+void editorRowAppendString(erow *row, char *s, size_t len) {
+  editorMarkModified(row->idx, row->size);
+  editorJournalRecord(J_APPEND, row->idx, 0, s, len);
+  editorUndoAdd(U_INSERT, row->idx, row->size, editorUndoText(s, len), len);
+  editorRowOwn(row);
+  row->chars = realloc(row->chars, row->size + len + 1);
+  memcpy(&row->chars[row->size], s, len);
+  row->size += len;
+  row->chars[row->size] = '\0';
+  editorRowChanged(row);
+  E.dirty++;
+}
+
+void editorRowDelChars(erow *row, int at, int len) {
+  if (at < 0 || at >= row->size || len <= 0) return;
+  if (len > row->size - at) len = row->size - at;
+  editorJournalRecord(J_DELETE, row->idx, at, &row->chars[at], len);
+  editorUndoAdd(U_DELETE, row->idx, at, editorUndoText(&row->chars[at], len), len);
+  editorRowOwn(row);
+  memmove(&row->chars[at], &row->chars[at + len], row->size - at - len + 1);
+  row->size -= len;
+  editorRowChanged(row);
+  E.dirty++;
+  editorMarkModified(row->idx, at);
+}
+
+void editorRowDelChar(erow *row, int at) {
+  editorRowDelChars(row, at, 1);
+}
+
+// Cut the row short at at
+void editorRowTruncate(erow *row, int at) {
+  if (at < 0 || at >= row->size) return;
+  editorJournalRecord(J_TRUNCATE, row->idx, at, NULL, 0);
+  editorUndoAdd(U_DELETE, row->idx, at, editorUndoText(&row->chars[at], row->size - at), row->size - at);
+  editorRowOwn(row);
+  row->size = at;
+  row->chars[at] = '\0';
+  editorRowChanged(row);
+  E.dirty++;
+  editorMarkModified(row->idx, at);
+}
+
+/*** editor operations ***/
+
+void editorInsertChar(int c) {
+  // Check if need to append new row before inserting character
+  if (E.cy == E.numrows) {
+    editorInsertRow(E.numrows, "", 0);
+  }
+  editorRowInsertChar(&E.row[E.cy], E.cx, c);
+  E.cx++;
+}
+
+// Insert lines as rows in one move, as an edit unlike editorInsertRows
+void editorInsertRowsEdit(int at, char *buf, size_t len) {
+  int before = E.numrows;
+  editorInsertRows(at, buf, len);
+  int n = E.numrows - before;
+  editorJournalRecord(J_INSERT_ROWS, at, 0, buf, len);
+  E.dirty += n;
+  editorMarkModified(at, 0);
+}
+
+// Remove rows in one move, as an edit unlike editorDelRows
+void editorDelRowsEdit(int at, int n) {
+  editorJournalRecord(J_DEL_ROWS, at, n, NULL, 0);
+  editorMarkModified(at, 0);
+  editorDelRows(at, n);
+  E.dirty += n;
+}
+
+// Insert text at row, col. Newlines in it split the row, and the lines
+// between go in as a block, so a paste of any size is one change for undo
+void editorInsertText(int row, int col, const char *s, size_t len) {
+  if (len == 0 || row < 0 || row > E.numrows) return;
+  const char *nl = memchr(s, '\n', len);
+  if (!nl && row < E.numrows) {
+    editorRowInsertString(&E.row[row], col, s, len);
+    return;
+  }
+
+  char *buf;
+  size_t blen;
+  int at;
+  E.undo.suspend++;
+  if (row == E.numrows || (col == 0 && s[len - 1] == '\n')) {
+    // Whole lines before a row or at the end, the rows around them are left alone
+    col = 0;
+    blen = len + (s[len - 1] != '\n');
+    buf = malloc(blen);
+    memcpy(buf, s, len);
+    buf[blen - 1] = '\n';
+    at = row;
+  } else {
+    // First line joins the start of the row, the last one takes the rest of it
+    erow *r = &E.row[row];
+    if (col > r->size) col = r->size;
+    size_t first = nl - s, rest = len - first - 1, tail = r->size - col;
+    blen = rest + tail + 1;
+    buf = malloc(blen);
+    memcpy(buf, nl + 1, rest);
+    memcpy(&buf[rest], &r->chars[col], tail);
+    buf[blen - 1] = '\n';
+    editorRowTruncate(r, col);
+    if (first) editorRowAppendString(&E.row[row], (char *)s, first);
+    at = row + 1;
+  }
+  editorInsertRowsEdit(at, buf, blen);
+  E.undo.suspend--;
+  // Past the end a line break is added, which undo has to take out again
+  if (at == row) editorUndoAdd(U_INSERT, row, col, buf, blen);
+  else {
+    editorUndoAdd(U_INSERT, row, col, editorUndoText(s, len), len);
+    free(buf);
+  }
+}
+
+// Delete len bytes from row, col on, where the end of each row counts as one
+// byte. Rows wholly inside the range are removed in one move
+void editorDeleteText(int row, int col, size_t len) {
+  if (len == 0 || row < 0 || row >= E.numrows) return;
+  if (col > E.row[row].size) col = E.row[row].size;
+
+  // Find the end of the range, copying it out for undo
+  char *text = malloc(len);
+  size_t got = 0;
+  int r = row, c = col;
+  while (got < len) {
+    size_t avail = E.row[r].size - c, take = len - got < avail ? len - got : avail;
+    memcpy(&text[got], &E.row[r].chars[c], take);
+    got += take;
+    c += take;
+    if (got == len) break;
+    // The last line break only goes along with whole rows
+    if (r == E.numrows - 1 && col > 0) break;
+    text[got++] = '\n';
+    r++;
+    c = 0;
+    if (r == E.numrows) break;
+  }
+
+  if (r == row) {
+    editorRowDelChars(&E.row[row], col, c - col);
+    free(text);
+    return;
+  }
+  E.undo.suspend++;
+  if (r == E.numrows) {
+    editorDelRowsEdit(row, r - row);
+  } else {
+    size_t tail = E.row[r].size - c;
+    char *rest = editorUndoText(&E.row[r].chars[c], tail);
+    editorRowTruncate(&E.row[row], col);
+    editorDelRowsEdit(row + 1, r - row);
+    if (tail) editorRowAppendString(&E.row[row], rest, tail);
+    free(rest);
+  }
+  E.undo.suspend--;
+  editorUndoAdd(U_DELETE, row, col, text, got);
+}
+
+void editorInsertNewline() {
+  // At the end of a folded line the new one goes below the rows hidden under it, which
+  // keeps the fold with its line and the cursor out of the fold
+  struct foldNode *f = E.cy < E.numrows && E.cx == E.row[E.cy].size ? editorFoldFind(E.cy + 1) : NULL;
+  if (f && f->start == E.cy + 1) {
+    E.cy = f->end;
+    E.cx = E.row[E.cy].size;
+  }
+  // At the beginning of a line this puts a blank row before it, otherwise the line is split in two
+  editorInsertText(E.cy, E.cx, "\n", 1);
+  // Move cursor to beginning of next line
+  E.cy++;
+  E.cx = 0;
+}
+
+void editorDelChar() {
+  // Check if cursor is past end of file or at the beginning of first line
+  if (E.cy == E.numrows) return;
+  if (E.cx == 0 && E.cy == 0) return;
+
+  // Get row cursor is on, if character to the left delete it
+  erow *row = &E.row[E.cy];
+  if (E.cx > 0) {
+    editorRowDelChar(row, E.cx - 1);
+    // Move cursor after deleting
+    E.cx--;
+  } else {
+    // Join the line onto the one above
+    E.cx = E.row[E.cy - 1].size;
+    editorDeleteText(E.cy - 1, E.cx, 1);
+    E.cy--;
+  }
+}
+
+/*** undo ***/
+
+// Position just past text placed at row, col
+void editorTextEnd(int row, int col, const char *text, size_t len, int *endrow, int *endcol) {
+  *endrow = row;
+  *endcol = col;
+  for (size_t j = 0; j < len; j++) {
+    (*endcol)++;
+    if (text[j] == '\n') {
+      (*endrow)++;
+      *endcol = 0;
+    }
+  }
+}
+
+// Free the records from from to to, returns the bytes they held
+size_t editorUndoRelease(struct undoRecord *rec, int from, int to) {
+  size_t bytes = 0;
+  for (int j = from; j < to; j++) {
+    bytes += sizeof(struct undoRecord) + rec[j].len;
+    if (!rec[j].mapped) free(rec[j].text);
+  }
+  return bytes;
+}
+
+void editorUndoFree(int from, int to) {
+  E.undo.bytes -= editorUndoRelease(E.undo.rec, from, to);
+}
+
+// Drop whole steps from the oldest end until the history fits, never the one being made
+void editorUndoTrim() {
+  struct editorUndo *u = &E.undo;
+  int drop = 0;
+  while (drop < u->cur && u->rec[drop].group != u->group &&
+         (u->bytes > KILO_UNDO_MAX || (drop > 0 && u->rec[drop].group == u->rec[drop - 1].group))) {
+    editorUndoFree(drop, drop + 1);
+    drop++;
+  }
+  if (drop) {
+    memmove(u->rec, &u->rec[drop], sizeof(struct undoRecord) * (u->n - drop));
+    u->n -= drop;
+    u->cur -= drop;
+    // Earlier sessions' changes no longer follow on from the oldest one left, so an
+    // undo must never reach back into them
+    u->indexed = 1;
+  }
+}
+
+// Start a new undo step, everything recorded until the next call is undone together
+void editorUndoBegin() {
+  E.undo.group++;
+  E.undo.typing = 0;
+}
+
+// Record a change, taking ownership of text
+void editorUndoAdd(int op, int row, int at, char *text, size_t len) {
+  struct editorUndo *u = &E.undo;
+  if (u->suspend || E.follow.active) {
+    free(text);
+    return;
+  }
+  // A new change ends what could be redone
+  editorUndoFree(u->cur, u->n);
+  u->n = u->cur;
+
+  // Keystrokes carrying on where the last one left off grow its record, and
+  // the keypress joins the last one's step
+  struct undoRecord *last = u->cur ? &u->rec[u->cur - 1] : NULL;
+  if (last && u->typing && last->typed && !last->mapped && last->group >= u->group - 1 && last->op == op) {
+    int endrow, endcol;
+    if (op == U_DELETE) editorTextEnd(row, at, text, len, &endrow, &endcol);
+    else editorTextEnd(last->row, last->at, last->text, last->len, &endrow, &endcol);
+    if ((op == U_INSERT && row == endrow && at == endcol) || (op == U_DELETE && row == last->row && at == last->at)) {
+      // Typing, or the Delete key pulling the next character to the same spot
+      last->text = realloc(last->text, last->len + len);
+      memcpy(&last->text[last->len], text, len);
+      last->len += len;
+      u->group = last->group;
+      u->bytes += len;
+      editorUndoWrite(UF_APPEND, last, text, len);
+      free(text);
+      return;
+    } else if (op == U_DELETE && endrow == last->row && endcol == last->at) {
+      // Backspace, the new text goes in front
+      char *both = malloc(len + last->len);
+      memcpy(both, text, len);
+      memcpy(&both[len], last->text, last->len);
+      free(last->text);
+      last->text = both;
+      last->row = row;
+      last->at = at;
+      last->len += len;
+      u->group = last->group;
+      u->bytes += len;
+      editorUndoWrite(UF_PREPEND, last, text, len);
+      free(text);
+      return;
+    }
+  }
+
+  if (u->n == u->cap) {
+    u->cap = u->cap ? u->cap * 2 : 256;
+    u->rec = realloc(u->rec, sizeof(struct undoRecord) * u->cap);
+  }
+  struct undoRecord *rec = &u->rec[u->n++];
+  rec->op = op;
+  rec->group = u->group;
+  rec->typed = u->typing;
+  rec->row = row;
+  rec->at = at;
+  rec->cy = E.cy;
+  rec->cx = E.cx;
+  rec->text = text;
+  rec->len = len;
+  u->cur = u->n;
+  u->bytes += sizeof(struct undoRecord) + len;
+
+  editorUndoWrite(UF_PUSH, rec, text, len);
+  editorUndoTrim();
+}
+
+// Keep the cursor inside the text after rows came or went
+void editorUndoClampCursor() {
+  if (E.cy > E.numrows) E.cy = E.numrows;
+  if (E.cy < 0) E.cy = 0;
+  int rowlen = E.cy < E.numrows ? E.row[E.cy].size : 0;
+  if (E.cx > rowlen) E.cx = rowlen;
+}
+
+// Take back the last step, with the cursor where it was before it
+void editorUndo() {
+  struct editorUndo *u = &E.undo;
+  if (u->cur == 0) editorUndoIndex();
+  if (u->cur == 0) {
+    editorSetStatusMessage("Nothing to undo");
+    return;
+  }
+  int group = u->rec[u->cur - 1].group;
+  u->suspend++;
+  while (u->cur > 0 && u->rec[u->cur - 1].group == group) {
+    struct undoRecord *r = &u->rec[--u->cur];
+    if (r->op == U_INSERT) editorDeleteText(r->row, r->at, r->len);
+    else editorInsertText(r->row, r->at, r->text, r->len);
+    E.cy = r->cy;
+    E.cx = r->cx;
+  }
+  u->suspend--;
+  editorUndoWrite(UF_UNDO, NULL, NULL, 0);
+  editorUndoClampCursor();
+}
+
+// Make the last undone step again, with the cursor at the end of it
+void editorRedo() {
+  struct editorUndo *u = &E.undo;
+  if (u->n == 0) editorUndoIndex();
+  if (u->cur == u->n) {
+    editorSetStatusMessage("Nothing to redo");
+    return;
+  }
+  int group = u->rec[u->cur].group;
+  u->suspend++;
+  while (u->cur < u->n && u->rec[u->cur].group == group) {
+    struct undoRecord *r = &u->rec[u->cur++];
+    if (r->op == U_DELETE) {
+      editorDeleteText(r->row, r->at, r->len);
+      E.cy = r->row;
+      E.cx = r->at;
+      continue;
+    }
+    editorInsertText(r->row, r->at, r->text, r->len);
+    editorTextEnd(r->row, r->at, r->text, r->len, &E.cy, &E.cx);
+  }
+  u->suspend--;
+  editorUndoWrite(UF_REDO, NULL, NULL, 0);
+  editorUndoClampCursor();
+}
+
+/*** undo file ***/
+
+// Undo files live in the cache directory, named by a hash of the file's full path
+char *editorUndoPath(const char *filename) {
+  char *full = realpath(filename, NULL);
+  if (full == NULL) return NULL;
+  const char *cache = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+  char *dir;
+  if (cache && *cache) {
+    dir = malloc(strlen(cache) + 8);
+    strcpy(dir, cache);
+  } else if (home && *home) {
+    dir = malloc(strlen(home) + 16);
+    sprintf(dir, "%s/.cache", home);
+  } else {
+    free(full);
+    return NULL;
+  }
+  mkdir(dir, 0700);
+  strcat(dir, "/gram");
+  mkdir(dir, 0700);
+  char *path = malloc(strlen(dir) + 32);
+  sprintf(path, "%s/%016llx.undo", dir, (unsigned long long)editorHash(full, strlen(full)));
+  free(dir);
+  free(full);
+  return path;
+}
+
+void editorUndoClose() {
+  struct editorUndo *u = &E.undo;
+  if (u->fd != -1) close(u->fd);
+  u->fd = -1;
+  free(u->path);
+  u->path = NULL;
+}
+
+// Append a frame, the file is given up on if it can't be written
+void editorUndoWrite(int kind, struct undoRecord *r, const char *text, size_t len) {
+  struct editorUndo *u = &E.undo;
+  if (u->fd == -1) return;
+  struct undoFrame f = { kind, 0, 0, 0, 0, 0, 0, len };
+  if (r) {
+    f.op = r->op;
+    f.group = r->group;
+    f.row = r->row;
+    f.at = r->at;
+    f.cy = r->cy;
+    f.cx = r->cx;
+  }
+  if (u->hold) {
+    if (u->plen + sizeof(f) + len > u->pcap) {
+      u->pcap = (u->plen + sizeof(f) + len) * 2;
+      u->pend = realloc(u->pend, u->pcap);
+    }
+    memcpy(&u->pend[u->plen], &f, sizeof(f));
+    if (len) memcpy(&u->pend[u->plen + sizeof(f)], text, len);
+    u->plen += sizeof(f) + len;
+    return;
+  }
+  struct iovec iov[2] = { { &f, sizeof(f) }, { (void *)text, len } };
+  if (pwritev(u->fd, iov, len ? 2 : 1, u->end) != (ssize_t)(sizeof(f) + len)) {
+    editorUndoClose();
+    return;
+  }
+  u->end += sizeof(f) + len;
+}
+
+// Write the frames held back since hold was set
+void editorUndoFlush() {
+  struct editorUndo *u = &E.undo;
+  u->hold = 0;
+  if (u->fd != -1 && u->plen) {
+    if (pwrite(u->fd, u->pend, u->plen, u->end) != (ssize_t)u->plen) editorUndoClose();
+    else u->end += u->plen;
+  }
+  u->plen = 0;
+}
+
+// Mark the first end bytes of the undo file as the history of the saved contents
+void editorUndoSaved(off_t end, int group, uint64_t hash, int rows) {
+  struct editorUndo *u = &E.undo;
+  if (u->fd == -1) return;
+  struct undoHeader h;
+  memcpy(h.magic, KILO_UNDO_MAGIC, sizeof(h.magic));
+  h.hash = hash;
+  h.rows = rows;
+  h.end = end;
+  h.group = group;
+  if (pwrite(u->fd, &h, sizeof(h), 0) != sizeof(h)) editorUndoClose();
+}
+
+// Start a new undo file for the file as it is now, holding the history made so far
+void editorUndoStart() {
+  struct editorUndo *u = &E.undo;
+  if (E.filename == NULL || E.batch.active || u->fd != -1) return;
+  u->path = editorUndoPath(E.filename);
+  if (u->path == NULL) return;
+  u->fd = open(u->path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (u->fd == -1) {
+    editorUndoClose();
+    return;
+  }
+  u->end = sizeof(struct undoHeader);
+  // Records as pushes, then undos down to where the cursor of the history is
+  for (int j = 0; j < u->n; j++) editorUndoWrite(UF_PUSH, &u->rec[j], u->rec[j].text, u->rec[j].len);
+  for (int j = u->n - 1; j >= u->cur; j--) {
+    if (j == u->cur || u->rec[j].group != u->rec[j - 1].group) editorUndoWrite(UF_UNDO, NULL, NULL, 0);
+  }
+  editorUndoSaved(u->end, u->group, E.doc_hash, E.numrows);
+}
+
+// Pick up the history left by earlier sessions if the file is still as they
+// saved it. Only the header is read, the frames are mapped and left alone
+// until an undo reaches back into them
+void editorUndoOpen() {
+  struct editorUndo *u = &E.undo;
+  if (E.filename == NULL || !E.disk_valid || E.readonly || u->fd != -1) return;
+  u->path = editorUndoPath(E.filename);
+  if (u->path == NULL) return;
+  u->fd = open(u->path, O_RDWR | O_CLOEXEC);
+  if (u->fd == -1) {
+    editorUndoClose();
+    editorUndoStart();
+    return;
+  }
+
+  struct undoHeader h;
+  struct stat st;
+  int usable = fstat(u->fd, &st) == 0 && pread(u->fd, &h, sizeof(h), 0) == sizeof(h) &&
+               !memcmp(h.magic, KILO_UNDO_MAGIC, sizeof(h.magic)) && h.hash == E.doc_hash &&
+               h.rows == E.numrows && h.end >= (int64_t)sizeof(h) && h.end <= st.st_size &&
+               h.end <= KILO_UNDO_FILE_MAX;
+  if (usable && h.end > (int64_t)sizeof(h)) {
+    char *map = mmap(NULL, h.end, PROT_READ, MAP_PRIVATE, u->fd, 0);
+    if (map == MAP_FAILED) {
+      usable = 0;
+    } else {
+      u->map = map;
+      u->maplen = h.end;
+      u->indexed = 0;
+    }
+  }
+  if (!usable) {
+    editorUndoClose();
+    editorUndoStart();
+    return;
+  }
+  // Frames after the last save were for edits that never reached the file
+  if (ftruncate(u->fd, h.end) == -1) {
+    editorUndoClose();
+    return;
+  }
+  u->end = h.end;
+  if (u->group <= h.group) u->group = h.group + 1;
+}
+
+// Rebuild the records of earlier sessions from the mapped frames and put them
+// in front of this session's, whose changes cut off anything they left to redo
+void editorUndoIndex() {
+  struct editorUndo *u = &E.undo;
+  if (u->map == NULL || u->indexed) return;
+  u->indexed = 1;
+
+  struct undoRecord *rec = NULL;
+  int n = 0, cap = 0, cur = 0;
+  size_t bytes = 0, off = sizeof(struct undoHeader);
+  struct undoFrame f;
+  while (off + sizeof(f) <= u->maplen) {
+    memcpy(&f, &u->map[off], sizeof(f));
+    char *text = &u->map[off + sizeof(f)];
+    if (off + sizeof(f) + f.len > u->maplen) break;
+    off += sizeof(f) + f.len;
+    if (f.kind == UF_PUSH || f.kind == UF_APPEND || f.kind == UF_PREPEND) {
+      bytes -= editorUndoRelease(rec, cur, n);
+      n = cur;
+    }
+    switch (f.kind) {
+      case UF_PUSH:
+        if (n == cap) {
+          cap = cap ? cap * 2 : 256;
+          rec = realloc(rec, sizeof(struct undoRecord) * cap);
+        }
+        rec[n].op = f.op;
+        rec[n].group = f.group;
+        rec[n].typed = 0;
+        rec[n].row = f.row;
+        rec[n].at = f.at;
+        rec[n].cy = f.cy;
+        rec[n].cx = f.cx;
+        rec[n].text = text;
+        rec[n].len = f.len;
+        rec[n].mapped = 1;
+        bytes += sizeof(struct undoRecord) + f.len;
+        cur = ++n;
+        break;
+      case UF_APPEND:
+      case UF_PREPEND:
+        if (cur == 0) break;
+        {
+          struct undoRecord *r = &rec[cur - 1];
+          char *both = malloc(r->len + f.len);
+          memcpy(f.kind == UF_APPEND ? both : &both[f.len], r->text, r->len);
+          memcpy(f.kind == UF_APPEND ? &both[r->len] : both, text, f.len);
+          if (!r->mapped) free(r->text);
+          r->text = both;
+          r->mapped = 0;
+          r->len += f.len;
+          bytes += f.len;
+          if (f.kind == UF_PREPEND) {
+            r->row = f.row;
+            r->at = f.at;
+          }
+        }
+        break;
+      case UF_UNDO:
+        if (cur == 0) break;
+        for (int g = rec[cur - 1].group; cur > 0 && rec[cur - 1].group == g; cur--);
+        break;
+      case UF_REDO:
+        if (cur == n) break;
+        for (int g = rec[cur].group; cur < n && rec[cur].group == g; cur++);
+        break;
+    }
+  }
+
+  if (u->n) {
+    bytes -= editorUndoRelease(rec, cur, n);
+    n = cur;
+    u->cur += n;
+  } else {
+    u->cur = cur;
+  }
+  if (n == 0) {
+    free(rec);
+    return;
+  }
+  if (n + u->n > cap) {
+    cap = n + u->n;
+    rec = realloc(rec, sizeof(struct undoRecord) * cap);
+  }
+  memcpy(&rec[n], u->rec, sizeof(struct undoRecord) * u->n);
+  free(u->rec);
+  u->rec = rec;
+  u->n += n;
+  u->cap = cap;
+  u->bytes += bytes;
+  editorUndoTrim();
+}
+
+// Forget all history, for when the rows are replaced by something that isn't an edit
+void editorUndoClear() {
+  struct editorUndo *u = &E.undo;
+  editorUndoFree(0, u->n);
+  u->n = u->cur = 0;
+  if (u->map) munmap(u->map, u->maplen);
+  u->map = NULL;
+  // The file starts over from the contents as they are now
+  if (u->fd != -1) {
+    u->end = sizeof(struct undoHeader);
+    if (ftruncate(u->fd, u->end) == -1) editorUndoClose();
+    editorUndoSaved(u->end, u->group, E.doc_hash, E.numrows);
+  }
+}
+
+/*** async i/o ***/
+
+int ioUringSetup(struct ioQueue *q, unsigned depth) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  int ring = syscall(__NR_io_uring_setup, depth, &p);
+  if (ring == -1) return -1;
+
+  // Needs the plain read and write operations, added in Linux 5.6
+  size_t psize = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe *probe = calloc(1, psize);
+  int ok = syscall(__NR_io_uring_register, ring, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+    probe->last_op >= IORING_OP_WRITE && (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+    (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+  free(probe);
+  if (!ok) {
+    close(ring);
+    return -1;
+  }
+
+  q->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  q->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  int single = p.features & IORING_FEAT_SINGLE_MMAP;
+  if (single) {
+    if (q->cq_size > q->sq_size) q->sq_size = q->cq_size;
+    q->cq_size = q->sq_size;
+  }
+  q->sq_map = mmap(NULL, q->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+  q->cq_map = single ? q->sq_map :
+    mmap(NULL, q->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+  q->sqe_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  q->sqes = mmap(NULL, q->sqe_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES);
+  if (q->sq_map == MAP_FAILED || q->cq_map == MAP_FAILED || q->sqes == MAP_FAILED) {
+    close(ring);
+    return -1;
+  }
+  char *sq = q->sq_map, *cq = q->cq_map;
+  q->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  q->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+  q->sq_array = (unsigned *)(sq + p.sq_off.array);
+  q->cq_head = (unsigned *)(cq + p.cq_off.head);
+  q->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  q->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+  q->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  // Completions bump the eventfd so the main loop can poll() for them
+  syscall(__NR_io_uring_register, ring, IORING_REGISTER_EVENTFD, &q->notify, 1);
+  q->ring = ring;
+  q->pending = 0;
+  return 0;
+}
+
+// Thread pool fallback, each thread does whole requests with pread and pwrite
+void *ioPoolThread(void *arg) {
+  struct ioQueue *q = arg;
+  pthread_mutex_lock(&q->lock);
+  while (1) {
+    while (!q->stop && q->ntodo == 0) pthread_cond_wait(&q->cond, &q->lock);
+    if (q->ntodo == 0) break;
+    struct ioRequest r = q->todo[0];
+    memmove(&q->todo[0], &q->todo[1], sizeof(struct ioRequest) * --q->ntodo);
+    pthread_mutex_unlock(&q->lock);
+
+    ssize_t res = 0;
+    while ((size_t)res < r.len) {
+      ssize_t n = r.op == IO_READ ? pread(r.fd, r.buf + res, r.len - res, r.off + res) :
+        pwrite(r.fd, r.buf + res, r.len - res, r.off + res);
+      if (n == -1 && errno == EINTR) continue;
+      if (n == -1) res = -errno;
+      if (n <= 0) break;
+      res += n;
+    }
+
+    pthread_mutex_lock(&q->lock);
+    q->done[q->ndone++] = (struct ioCompletion){ r.data, res };
+    pthread_cond_broadcast(&q->donecond);
+    uint64_t one = 1;
+    write(q->notify, &one, sizeof(one));
+  }
+  pthread_mutex_unlock(&q->lock);
+  return NULL;
+}
+
+// Set up a queue for up to depth requests at a time, using io_uring when the kernel has it
+void ioQueueInit(struct ioQueue *q, int depth) {
+  q->depth = depth;
+  q->inflight = 0;
+  q->notify = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (q->notify == -1) die("eventfd");
+  q->uring = !getenv("GRAM_NO_URING") && ioUringSetup(q, depth) == 0;
+  if (q->uring) return;
+
+  q->todo = malloc(sizeof(struct ioRequest) * depth);
+  q->done = malloc(sizeof(struct ioCompletion) * depth);
+  q->ntodo = 0;
+  q->ndone = 0;
+  q->stop = 0;
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->cond, NULL);
+  pthread_cond_init(&q->donecond, NULL);
+  for (int i = 0; i < KILO_IO_THREADS; i++) {
+    if (pthread_create(&q->threads[i], NULL, ioPoolThread, q) != 0) die("pthread_create");
+  }
+}
+
+// Queue a read or write of len bytes at off. Nothing starts until ioFlush or ioReap
+void ioSubmit(struct ioQueue *q, int op, int fd, char *buf, size_t len, off_t off, void *data) {
+  q->inflight++;
+  if (q->uring) {
+    unsigned tail = *q->sq_tail;
+    unsigned idx = tail & q->sq_mask;
+    struct io_uring_sqe *sqe = &q->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op == IO_READ ? IORING_OP_READ : IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->user_data = (uintptr_t)data;
+    q->sq_array[idx] = idx;
+    __atomic_store_n(q->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    q->pending++;
+    return;
+  }
+  pthread_mutex_lock(&q->lock);
+  q->todo[q->ntodo++] = (struct ioRequest){ op, fd, buf, len, off, data };
+  pthread_cond_signal(&q->cond);
+  pthread_mutex_unlock(&q->lock);
+}
+
+// Hand everything queued so far to the kernel in one system call
+void ioFlush(struct ioQueue *q) {
+  while (q->uring && q->pending) {
+    int n = syscall(__NR_io_uring_enter, q->ring, q->pending, 0, 0, NULL, 0);
+    if (n == -1 && errno == EINTR) continue;
+    if (n <= 0) break;
+    q->pending -= n;
+  }
+}
+
+// Collect up to max finished requests, waiting for at least one if wait is set
+int ioReap(struct ioQueue *q, struct ioCompletion *out, int max, int wait) {
+  uint64_t count;
+  ioFlush(q);
+  // Reset the eventfd before looking, a completion after this wakes poll() again
+  read(q->notify, &count, sizeof(count));
+  int n = 0;
+  if (q->uring) {
+    while (1) {
+      unsigned head = *q->cq_head;
+      unsigned tail = __atomic_load_n(q->cq_tail, __ATOMIC_ACQUIRE);
+      while (head != tail && n < max) {
+        struct io_uring_cqe *cqe = &q->cqes[head & q->cq_mask];
+        out[n++] = (struct ioCompletion){ (void *)(uintptr_t)cqe->user_data, cqe->res };
+        head++;
+      }
+      __atomic_store_n(q->cq_head, head, __ATOMIC_RELEASE);
+      if (n || !wait || !q->inflight) break;
+      syscall(__NR_io_uring_enter, q->ring, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+    }
+  } else {
+    pthread_mutex_lock(&q->lock);
+    while (wait && q->inflight && q->ndone == 0) pthread_cond_wait(&q->donecond, &q->lock);
+    n = q->ndone < max ? q->ndone : max;
+    memcpy(out, q->done, sizeof(struct ioCompletion) * n);
+    memmove(&q->done[0], &q->done[n], sizeof(struct ioCompletion) * (q->ndone - n));
+    q->ndone -= n;
+    pthread_mutex_unlock(&q->lock);
+  }
+  q->inflight -= n;
+  return n;
+}
+
+// Wait for anything still in flight, since it may be writing into buffers about to be freed
+void ioQueueFree(struct ioQueue *q) {
+  struct ioCompletion done[KILO_IO_DEPTH];
+  while (q->inflight) ioReap(q, done, KILO_IO_DEPTH, 1);
+  if (q->uring) {
+    munmap(q->sqes, q->sqe_size);
+    if (q->cq_map != q->sq_map) munmap(q->cq_map, q->cq_size);
+    munmap(q->sq_map, q->sq_size);
+    close(q->ring);
+  } else {
+    pthread_mutex_lock(&q->lock);
+    q->stop = 1;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+    for (int i = 0; i < KILO_IO_THREADS; i++) pthread_join(q->threads[i], NULL);
+    free(q->todo);
+    free(q->done);
+  }
+  close(q->notify);
+}
+
+/*** encodings ***/
+
+// Exact per-byte zero test: the high bit of each byte of the result is set where w has a zero byte
+uint64_t editorZeroBytes(uint64_t w) {
+  const uint64_t low7 = 0x7f7f7f7f7f7f7f7fULL;
+  return ~(((w & low7) + low7) | w | low7);
+}
+
+// Check that buf is well-formed UTF-8, a sequence cut off by the end of buf is allowed
+int editorValidUtf8(const unsigned char *s, size_t len) {
+  size_t i = 0;
+  while (i < len) {
+    // Skip eight ASCII bytes at a time
+    if (i + 8 <= len) {
+      uint64_t w;
+      memcpy(&w, &s[i], 8);
+      if (!(w & SWAR_HIGHS)) {
+        i += 8;
+        continue;
+      }
+    }
+    unsigned char c = s[i];
+    if (c < 0x80) {
+      i++;
+      continue;
+    }
+    int n;
+    uint32_t cp;
+    if ((c & 0xe0) == 0xc0) n = 1, cp = c & 0x1f;
+    else if ((c & 0xf0) == 0xe0) n = 2, cp = c & 0x0f;
+    else if ((c & 0xf8) == 0xf0) n = 3, cp = c & 0x07;
+    else return 0;
+    if (i + n >= len) return 1;
+    for (int k = 1; k <= n; k++) {
+      if ((s[i + k] & 0xc0) != 0x80) return 0;
+      cp = (cp << 6) | (s[i + k] & 0x3f);
+    }
+    // Overlong forms, surrogates and code points past the end of Unicode
+    if ((n == 1 && cp < 0x80) || (n == 2 && cp < 0x800) || (n == 3 && (cp < 0x10000 || cp > 0x10ffff)) ||
+        (cp >= 0xd800 && cp <= 0xdfff)) {
+      return 0;
+    }
+    i += n + 1;
+  }
+  return 1;
+}
+
+// Guess the encoding of a file from its first bytes, *bom is set to the length of a byte order mark
+int editorDetectEncoding(const unsigned char *buf, size_t len, size_t *bom) {
+  *bom = 0;
+  if (len >= 3 && !memcmp(buf, "\xef\xbb\xbf", 3)) {
+    *bom = 3;
+    return ENC_UTF8;
+  }
+  if (len >= 2 && buf[0] == 0xff && buf[1] == 0xfe) {
+    *bom = 2;
+    return ENC_UTF16LE;
+  }
+  if (len >= 2 && buf[0] == 0xfe && buf[1] == 0xff) {
+    *bom = 2;
+    return ENC_UTF16BE;
+  }
+
+  // ASCII text in UTF-16 has a zero in every other byte, odd positions for
+  // little endian and even ones for big endian
+  static const unsigned char even[8] = { 0x80, 0, 0x80, 0, 0x80, 0, 0x80, 0 };
+  uint64_t evenmask;
+  memcpy(&evenmask, even, 8);
+  size_t zeven = 0, zodd = 0, i;
+  for (i = 0; i + 8 <= len; i += 8) {
+    uint64_t w;
+    memcpy(&w, &buf[i], 8);
+    uint64_t z = editorZeroBytes(w);
+    zeven += __builtin_popcountll(z & evenmask);
+    zodd += __builtin_popcountll(z & ~evenmask & SWAR_HIGHS);
+  }
+  size_t pairs = i / 2;
+  if (pairs && zodd * 10 > pairs * 3 && zeven * 20 < pairs) return ENC_UTF16LE;
+  if (pairs && zeven * 10 > pairs * 3 && zodd * 20 < pairs) return ENC_UTF16BE;
+
+  return editorValidUtf8(buf, len) ? ENC_UTF8 : ENC_LATIN1;
+}
+
+// Write cp as UTF-8, returns the number of bytes
+int editorPutUtf8(char *o, uint32_t cp) {
+  if (cp < 0x80) {
+    o[0] = cp;
+    return 1;
+  } else if (cp < 0x800) {
+    o[0] = 0xc0 | (cp >> 6);
+    o[1] = 0x80 | (cp & 0x3f);
+    return 2;
+  } else if (cp < 0x10000) {
+    o[0] = 0xe0 | (cp >> 12);
+    o[1] = 0x80 | ((cp >> 6) & 0x3f);
+    o[2] = 0x80 | (cp & 0x3f);
+    return 3;
+  }
+  o[0] = 0xf0 | (cp >> 18);
+  o[1] = 0x80 | ((cp >> 12) & 0x3f);
+  o[2] = 0x80 | ((cp >> 6) & 0x3f);
+  o[3] = 0x80 | (cp & 0x3f);
+  return 4;
+}
+
+// Convert len bytes in enc to UTF-8 in out, which needs room for 2 * len bytes.
+// Stops before a character cut off at the end and sets *used to the bytes consumed
+size_t editorDecode(int enc, const unsigned char *in, size_t len, char *out, size_t *used) {
+  char *o = out;
+  size_t i = 0;
+  if (enc == ENC_LATIN1) {
+    while (i < len) {
+      // Eight ASCII bytes at a time are copied as they are
+      if (i + 8 <= len) {
+        uint64_t w;
+        memcpy(&w, &in[i], 8);
+        if (!(w & SWAR_HIGHS)) {
+          memcpy(o, &in[i], 8);
+          o += 8;
+          i += 8;
+          continue;
+        }
+      }
+      o += editorPutUtf8(o, in[i++]);
+    }
+  } else if (enc == ENC_UTF16LE || enc == ENC_UTF16BE) {
+    int be = enc == ENC_UTF16BE;
+    // Bits that must be clear for four code units to all be ASCII
+    static const unsigned char asciile[8] = { 0x80, 0xff, 0x80, 0xff, 0x80, 0xff, 0x80, 0xff };
+    static const unsigned char asciibe[8] = { 0xff, 0x80, 0xff, 0x80, 0xff, 0x80, 0xff, 0x80 };
+    uint64_t mask;
+    memcpy(&mask, be ? asciibe : asciile, 8);
+    while (i + 2 <= len) {
+      if (i + 8 <= len) {
+        uint64_t w;
+        memcpy(&w, &in[i], 8);
+        if (!(w & mask)) {
+          o[0] = in[i + be];
+          o[1] = in[i + 2 + be];
+          o[2] = in[i + 4 + be];
+          o[3] = in[i + 6 + be];
+          o += 4;
+          i += 8;
+          continue;
+        }
+      }
+      uint32_t cp = be ? (in[i] << 8 | in[i + 1]) : (in[i] | in[i + 1] << 8);
+      if (cp >= 0xd800 && cp <= 0xdbff) {
+        if (i + 4 > len) break; // Other half of the pair comes with the next call
+        uint32_t lo = be ? (in[i + 2] << 8 | in[i + 3]) : (in[i + 2] | in[i + 3] << 8);
+        if (lo >= 0xdc00 && lo <= 0xdfff) {
+          cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+          i += 2;
+        } else {
+          cp = 0xfffd;
+        }
+      } else if (cp >= 0xdc00 && cp <= 0xdfff) {
+        cp = 0xfffd;
+      }
+      i += 2;
+      o += editorPutUtf8(o, cp);
+    }
+  } else {
+    memcpy(o, in, len);
+    o += len;
+    i = len;
+  }
+  *used = i;
+  return o - out;
+}
+
+// Decode a whole file at once, a character cut off at the end becomes U+FFFD
+char *editorDecodeAll(int enc, const unsigned char *in, size_t len, size_t *outlen) {
+  char *out = malloc(2 * len + 4);
+  size_t used;
+  *outlen = editorDecode(enc, in, len, out, &used);
+  if (used < len) *outlen += editorPutUtf8(&out[*outlen], 0xfffd);
+  return out;
+}
+
+// Convert the UTF-8 buffer back to enc for saving, with a byte order mark if the file had one.
+// Characters Latin-1 has no room for are written as '?' and counted in *lost
+char *editorEncode(int enc, int bom, const char *text, size_t len, size_t *outlen, size_t *lost) {
+  const unsigned char *in = (const unsigned char *)text;
+  char *out = malloc(2 * len + 4), *o = out;
+  *lost = 0;
+  int be = enc == ENC_UTF16BE;
+  if (bom) {
+    if (enc == ENC_UTF8) o += editorPutUtf8(o, 0xfeff);
+    else if (enc != ENC_LATIN1) {
+      *o++ = be ? 0xfe : 0xff;
+      *o++ = be ? 0xff : 0xfe;
+    }
+  }
+  // Text is held as UTF-8 already, copy it as it is so stray bytes survive the save
+  if (enc == ENC_UTF8) {
+    memcpy(o, text, len);
+    *outlen = o + len - out;
+    return out;
+  }
+  size_t i = 0;
+  while (i < len) {
+    // Runs of ASCII are the same in Latin-1, and just need a zero byte for UTF-16
+    if (i + 8 <= len) {
+      uint64_t w;
+      memcpy(&w, &in[i], 8);
+      if (!(w & SWAR_HIGHS)) {
+        if (enc == ENC_LATIN1) {
+          memcpy(o, &in[i], 8);
+          o += 8;
+        } else {
+          for (int k = 0; k < 8; k++) {
+            o[2 * k + be] = in[i + k];
+            o[2 * k + !be] = 0;
+          }
+          o += 16;
+        }
+        i += 8;
+        continue;
+      }
+    }
+    // Decode one character, a stray byte stands for itself
+    uint32_t cp = in[i];
+    int n = 0;
+    if (cp >= 0xc0 && cp < 0xe0) n = 1, cp &= 0x1f;
+    else if (cp >= 0xe0 && cp < 0xf0) n = 2, cp &= 0x0f;
+    else if (cp >= 0xf0 && cp < 0xf8) n = 3, cp &= 0x07;
+    int k;
+    for (k = 1; k <= n && i + k < len && (in[i + k] & 0xc0) == 0x80; k++) cp = (cp << 6) | (in[i + k] & 0x3f);
+    if (k <= n) {
+      cp = in[i];
+      n = 0;
+    }
+    i += n + 1;
+
+    if (enc == ENC_LATIN1) {
+      if (cp > 0xff) {
+        cp = '?';
+        (*lost)++;
+      }
+      *o++ = cp;
+    } else {
+      uint32_t units[2] = { cp, 0 };
+      int nu = 1;
+      if (cp >= 0x10000) {
+        units[0] = 0xd800 + ((cp - 0x10000) >> 10);
+        units[1] = 0xdc00 + ((cp - 0x10000) & 0x3ff);
+        nu = 2;
+      }
+      for (int u = 0; u < nu; u++) {
+        o[be] = units[u] & 0xff;
+        o[!be] = units[u] >> 8;
+        o += 2;
+      }
+    }
+  }
+  *outlen = o - out;
+  return out;
+}
+
+const char *editorEncodingName(int enc) {
+  switch (enc) {
+    case ENC_UTF16LE: return "utf-16le";
+    case ENC_UTF16BE: return "utf-16be";
+    case ENC_LATIN1: return "latin-1";
+    default: return "utf-8";
+  }
+}
+
+/*** file i/o ***/
+
+char *editorRowsToString(size_t *buflen) {
+  size_t totlen = 0;
+  int j;
+  // Add up lenghts of each row of text
+  for (j = 0; j < E.numrows; j++) {
+    totlen += E.row[j].size + 1; // Add one for the newline character
+  }
+  // Save total length into buflen to allocate memory
+  *buflen = totlen;
+
+  char *buf = malloc(totlen);
+  char *p = buf;
+  // Loop through rows
+  for (j = 0; j < E.numrows; j++) {
+    memcpy(p, E.row[j].chars, E.row[j].size);
+    p += E.row[j].size;
+    *p = '\n'; // Add newline after each row
+    p++;
+  }
+
+  return buf;
+}
+
+// Open and reading file from disk. The first screen is read here, the rest of
+// the file is loaded in the background while the editor is already running
+void editorOpen(char *filename) {
+  free(E.filename);
+  E.filename = strdup(filename);
+
+  editorSelectSyntaxHighlight();
+
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) die("open");
+  E.disk_valid = (fstat(fd, &E.disk) == 0);
+
+  struct lineSplitter *ls = &E.stream.lines;
+  ls->plen = 0;
+  ls->off = 0;
+  char *buf = malloc(KILO_FIRST_SCREEN);
+  ssize_t n;
+  size_t got = 0;
+  while (got < KILO_FIRST_SCREEN && (n = read(fd, buf + got, KILO_FIRST_SCREEN - got)) > 0) got += n;
+  size_t bom;
+  int enc = editorDetectEncoding((unsigned char *)buf, got, &bom);
+  // Binary files get the hex view instead of rows, UTF-16 is full of zero bytes so isn't checked
+  if (enc != ENC_UTF16LE && enc != ENC_UTF16BE && editorIsBinary((unsigned char *)buf, got)) {
+    free(buf);
+    editorHexOpen(fd);
+    close(fd);
+    return;
+  }
+  E.encoding = enc;
+  E.bom = bom;
+  ls->enc = enc;
+  ls->ncarry = 0;
+  // Only rows of a plain UTF-8 file are stored byte for byte as on disk
+  if (enc != ENC_UTF8 || bom) ls->off = -1;
+  editorAppendText(ls, buf + bom, got - bom);
+  free(buf);
+  E.dirty = 0;
+  E.mod_row = E.numrows + 1;
+  E.mod_col = 0;
+
+  // Scripts have nothing to draw while the rest loads, so read it all now
+  if (E.batch.active) {
+    buf = malloc(KILO_SAVE_CHUNK);
+    while ((n = read(fd, buf, KILO_SAVE_CHUNK)) > 0) editorAppendText(ls, buf, n);
+    free(buf);
+    got = 0;
+  }
+  if (got < KILO_FIRST_SCREEN) {
+    editorFlushText(ls);
+    close(fd);
+    editorLoadComplete();
+    return;
+  }
+  editorStreamOpen(fd, filename, E.disk.st_size);
+  E.stream.total = got;
+}
+
+// Everything that needs the whole file, run once it has been read
+void editorLoadComplete() {
+  // Column widths were picked from the first screen, sample the whole file instead
+  E.csv.stale = 1;
+  editorMarkSaved(E.doc_hash);
+  E.dirty = 0;
+  E.mod_row = E.numrows + 1;
+  E.mod_col = 0;
+  // Scripts run unattended and once, so there is nothing to recover or watch
+  if (E.batch.active) return;
+  // History has to be matched against the file before recovered edits change it
+  editorUndoOpen();
+  editorJournalRecover();
+  editorWatchStart();
+}
+
+// Write len bytes of buf to fd at *pos and add them to the job's progress. The buffer
+// goes out in chunks, several at a time, and *pos moves past it once all are written
+int editorSaveWrite(struct editorSaveJob *job, int fd, char *buf, size_t len, off_t *pos) {
+  struct ioQueue *q = &job->io;
+  struct ioSpan span[KILO_IO_DEPTH];
+  struct ioCompletion done[KILO_IO_DEPTH];
+  int idle[KILO_IO_DEPTH], nidle = KILO_IO_DEPTH;
+  for (int i = 0; i < KILO_IO_DEPTH; i++) idle[i] = i;
+  size_t sent = 0;
+  int err = 0;
+  while (1) {
+    while (!err && sent < len && nidle) {
+      struct ioSpan *sp = &span[idle[--nidle]];
+      sp->buf = buf + sent;
+      sp->len = len - sent > KILO_SAVE_CHUNK ? KILO_SAVE_CHUNK : len - sent;
+      sp->off = *pos + sent;
+      sent += sp->len;
+      ioSubmit(q, IO_WRITE, fd, sp->buf, sp->len, sp->off, sp);
+    }
+    if (!q->inflight) break;
+    int n = ioReap(q, done, KILO_IO_DEPTH, 1);
+    for (int i = 0; i < n; i++) {
+      struct ioSpan *sp = done[i].data;
+      ssize_t w = done[i].res;
+      if (w <= 0) {
+        if (!err) err = w < 0 ? -w : EIO;
+        idle[nidle++] = sp - span;
+        continue;
+      }
+      pthread_mutex_lock(&job->lock);
+      job->written += w;
+      pthread_mutex_unlock(&job->lock);
+      if ((size_t)w < sp->len) {
+        // Short write, send the rest of the chunk again
+        sp->buf += w;
+        sp->len -= w;
+        sp->off += w;
+        ioSubmit(q, IO_WRITE, fd, sp->buf, sp->len, sp->off, sp);
+      } else {
+        idle[nidle++] = sp - span;
+      }
+    }
+  }
+  if (!err) *pos += len;
+  return err;
+}
+
+// Copy len bytes at off in the original to fd at *pos, letting the kernel share extents where it can
+int editorSaveCopy(struct editorSaveJob *job, int fd, off_t off, size_t len, off_t *pos) {
+  while (len > 0) {
+    ssize_t c = copy_file_range(job->srcfd, &off, fd, pos, len, 0);
+    if (c == -1 && errno == EINTR) continue;
+    if (c == 0) return EIO; // Original got shorter under us
+    if (c == -1) break;
+    len -= c;
+    pthread_mutex_lock(&job->lock);
+    job->written += c;
+    job->copied += c;
+    pthread_mutex_unlock(&job->lock);
+  }
+  if (len == 0) return 0;
+
+  // Not supported between these files, read the rest through a buffer
+  char *tmp = malloc(KILO_SAVE_CHUNK);
+  int err = 0;
+  while (!err && len > 0) {
+    size_t n = len > KILO_SAVE_CHUNK ? KILO_SAVE_CHUNK : len;
+    ssize_t r = pread(job->srcfd, tmp, n, off);
+    if (r == -1 && errno == EINTR) continue;
+    if (r <= 0) {
+      err = r == 0 ? EIO : errno;
+      break;
+    }
+    err = editorSaveWrite(job, fd, tmp, r, pos);
+    off += r;
+    len -= r;
+  }
+  free(tmp);
+  return err;
+}
+
+// Write job->buf to a temporary file next to job->path, flush it and rename it over the original
+int editorWriteAtomic(struct editorSaveJob *job) {
+  // Temporary file must be in the same directory for rename() to be atomic
+  char *slash = strrchr(job->path, '/');
+  int dirlen = slash ? slash - job->path : 0;
+  char *dir = slash ? strndup(job->path, dirlen ? dirlen : 1) : strdup(".");
+  char *tmp = malloc(strlen(job->path) + 16);
+  sprintf(tmp, "%.*s%s.%s.XXXXXX", dirlen, job->path, slash ? "/" : "", slash ? slash + 1 : job->path);
+
+  int err = 0;
+  int fd = mkstemp(tmp);
+  if (fd == -1) {
+    err = errno;
+    goto out;
+  }
+  if (fchmod(fd, job->mode) == -1) err = errno;
+
+  // Write in chunks so progress can be reported while writing
+  off_t pos = 0;
+  if (job->ext) {
+    char *p = job->buf;
+    int i;
+    for (i = 0; !err && i < job->numext; i++) {
+      if (job->ext[i].src == -1) {
+        err = editorSaveWrite(job, fd, p, job->ext[i].len, &pos);
+        p += job->ext[i].len;
+      } else {
+        err = editorSaveCopy(job, fd, job->ext[i].src, job->ext[i].len, &pos);
+      }
+    }
+  } else if (!err) {
+    err = editorSaveWrite(job, fd, job->buf, job->len, &pos);
+  }
+
+  // Make sure data is on disk before it replaces the original
+  if (!err && fsync(fd) == -1) err = errno;
+  if (close(fd) == -1 && !err) err = errno;
+  if (!err && rename(tmp, job->path) == -1) err = errno;
+  if (err) {
+    unlink(tmp);
+    goto out;
+  }
+
+  // Flush directory so the rename itself survives a crash
+  int dfd = open(dir, O_RDONLY | O_DIRECTORY);
+  if (dfd != -1) {
+    if (fsync(dfd) == -1) err = errno;
+    close(dfd);
+  }
+
+out:
+  free(tmp);
+  free(dir);
+  return err;
+}
+
+// Overwrite the existing file from job->offset and cut it to the new length
+int editorWriteInPlace(struct editorSaveJob *job) {
+  int err = 0;
+  int fd = open(job->path, O_WRONLY);
+  if (fd == -1) return errno;
+
+  off_t pos = job->offset;
+  err = editorSaveWrite(job, fd, job->buf, job->len, &pos);
+
+  if (!err && ftruncate(fd, job->offset + job->len) == -1) err = errno;
+  if (!err && fdatasync(fd) == -1) err = errno;
+  if (close(fd) == -1 && !err) err = errno;
+  return err;
+}
+
+void *editorSaveThread(void *arg) {
+  struct editorSaveJob *job = arg;
+  ioQueueInit(&job->io, KILO_IO_DEPTH);
+  int err = job->inplace ? editorWriteInPlace(job) : editorWriteAtomic(job);
+  ioQueueFree(&job->io);
+
+  pthread_mutex_lock(&job->lock);
+  job->err = err;
+  job->done = 1;
+  pthread_mutex_unlock(&job->lock);
+  return NULL;
+}
+
+// Report the result of a joined save thread and release its snapshot
+void editorFinishSave() {
+  struct editorSaveJob *job = &E.save;
+  job->active = 0;
+  if (job->err == 0) {
+    // Edits made while the thread was writing still need saving
+    if (E.dirty == job->dirty) E.dirty = 0;
+    E.disk_valid = (stat(job->path, &E.disk) == 0);
+    E.crlf = 0;
+    E.saved_hash = job->hash;
+    E.saved_rows = job->rows;
+    E.saved_valid = 1;
+    // Records up to the snapshot are now part of the file
+    if (E.journal.running) {
+      editorJournalReset(job->journal_mark);
+    } else {
+      editorJournalStart();
+    }
+    // History up to the snapshot is what a later session can undo through
+    if (E.undo.fd != -1) {
+      editorUndoSaved(job->undo_end, job->undo_group, job->hash, job->rows);
+    } else if (E.doc_hash == job->hash) {
+      editorUndoStart();
+    }
+    // Rows not edited since the snapshot now live where the save put them
+    int j;
+    for (j = 0; j < E.numrows; j++) E.row[j].off = E.row[j].save_off;
+    if (job->inplace) {
+      editorSetStatusMessage("%zu bytes written to disk at offset %lld", job->len, (long long)job->offset);
+    } else if (job->ext) {
+      editorSetStatusMessage("%zu bytes saved: %zu copied, %zu written", job->len, job->copied, job->len - job->copied);
+    } else {
+      editorSetStatusMessage("%zu bytes written to disk", job->len);
+    }
+  } else {
+    // Nothing is known to be on disk, so the snapshot's changes are still pending
+    editorMarkModified(job->mod_row, job->mod_col);
+    editorSetStatusMessage("Can't save! I/O error: %s", strerror(job->err));
+  }
+  if (job->srcfd != -1) close(job->srcfd);
+  free(job->ext);
+  free(job->buf);
+  free(job->path);
+  job->srcfd = -1;
+  job->ext = NULL;
+  job->buf = NULL;
+  job->path = NULL;
+}
+
+// Check on a running save, returns 1 if the status bar changed
+int editorPollSave() {
+  struct editorSaveJob *job = &E.save;
+  if (!job->active) return 0;
+
+  pthread_mutex_lock(&job->lock);
+  int done = job->done;
+  int pct = job->len ? (int)(job->written * 100 / job->len) : 100;
+  pthread_mutex_unlock(&job->lock);
+
+  if (!done) {
+    // Only redraw when the percentage moved
+    if (pct == job->shown) return 0;
+    job->shown = pct;
+    editorSetStatusMessage("Saving %s... %d%%", job->path, pct);
+    return 1;
+  }
+
+  pthread_join(job->thread, NULL);
+  editorFinishSave();
+  return 1;
+}
+
+// Block until a running save has finished
+void editorWaitSave() {
+  if (!E.save.active) return;
+  pthread_join(E.save.thread, NULL);
+  editorFinishSave();
+}
+
+// Check the file at path is still the one last read or written, filling in st
+int editorDiskUnchanged(char *path, struct stat *st) {
+  if (!E.disk_valid || stat(path, st) == -1 || !S_ISREG(st->st_mode)) return 0;
+  return st->st_ino == E.disk.st_ino && st->st_dev == E.disk.st_dev && st->st_size == E.disk.st_size &&
+         st->st_mtim.tv_sec == E.disk.st_mtim.tv_sec && st->st_mtim.tv_nsec == E.disk.st_mtim.tv_nsec;
+}
+
+// Remember hash as the state of the file on disk
+void editorMarkSaved(uint64_t hash) {
+  E.saved_hash = hash;
+  E.saved_rows = E.numrows;
+  E.saved_valid = 1;
+}
+
+// Snapshot for a full save: rows still on disk at consecutive offsets become copy extents,
+// everything else is gathered into job->buf
+void editorSnapshotExtents(struct editorSaveJob *job) {
+  size_t memlen = 0;
+  int j;
+  for (j = 0; j < E.numrows; j++) {
+    if (E.row[j].off == -1) memlen += E.row[j].size + 1;
+  }
+  job->buf = malloc(memlen ? memlen : 1);
+
+  int cap = 16;
+  job->ext = malloc(sizeof(struct saveExtent) * cap);
+  job->numext = 0;
+  char *p = job->buf;
+  off_t out = 0;
+  for (j = 0; j < E.numrows; j++) {
+    erow *row = &E.row[j];
+    size_t len = row->size + 1;
+    struct saveExtent *last = job->numext ? &job->ext[job->numext - 1] : NULL;
+    if (row->off == -1) {
+      memcpy(p, row->chars, row->size);
+      p[row->size] = '\n';
+      p += len;
+    }
+    // Extend the previous extent if this row continues it
+    if (last && ((row->off == -1 && last->src == -1) ||
+                 (row->off != -1 && last->src != -1 && last->src + (off_t)last->len == row->off))) {
+      last->len += len;
+    } else {
+      if (job->numext == cap) {
+        cap *= 2;
+        job->ext = realloc(job->ext, sizeof(struct saveExtent) * cap);
+      }
+      job->ext[job->numext].src = row->off;
+      job->ext[job->numext].len = len;
+      job->numext++;
+    }
+    row->save_off = out;
+    out += len;
+  }
+  job->len = out;
+}
+
+void editorSave() {
+  if (E.save.active) {
+    editorSetStatusMessage("Save already in progress");
+    return;
+  }
+
+  // Check if new file
+  if (E.filename == NULL) {
+    E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
+    if (E.filename == NULL) {
+      editorSetStatusMessage("Save aborted");
+      return;
+    }
+    editorSelectSyntaxHighlight();
+    editorWatchStart();
+  }
+
+  if (E.watch.conflict && !editorConfirm("%s changed on disk since it was read. Overwrite? (y/n)", E.filename)) {
+    editorSetStatusMessage("Save aborted");
+    return;
+  }
+  E.watch.conflict = 0;
+
+  // Edits that cancelled out leave the file as it is, don't touch it
+  struct stat st;
+  if (E.saved_valid && E.doc_hash == E.saved_hash && E.numrows == E.saved_rows &&
+      editorDiskUnchanged(E.filename, &st)) {
+    E.dirty = 0;
+    E.mod_row = E.numrows + 1;
+    E.mod_col = 0;
+    if (E.journal.running) editorJournalReset(E.journal.total);
+    editorSetStatusMessage("No changes to save");
+    return;
+  }
+
+  struct editorSaveJob *job = &E.save;
+  // Replace the target of a symlink rather than the link itself
+  job->path = realpath(E.filename, NULL);
+  if (job->path == NULL) job->path = strdup(E.filename);
+
+  // Keep permissions of an existing file, otherwise use the default for new files
+  if (stat(job->path, &st) == 0) {
+    job->mode = st.st_mode & 07777;
+  } else {
+    mode_t mask = umask(0);
+    umask(mask);
+    job->mode = 0644 & ~mask;
+  }
+
+  job->inplace = 0;
+  job->offset = 0;
+  job->mod_row = E.mod_row;
+  job->mod_col = E.mod_col;
+  job->srcfd = -1;
+  job->ext = NULL;
+  job->numext = 0;
+  job->copied = 0;
+  int unchanged = editorDiskUnchanged(job->path, &st);
+  // Large files whose start is unchanged since we last read or wrote them only get the tail rewritten
+  // Both need rows stored exactly as on disk, so only work for plain UTF-8
+  int exact = E.encoding == ENC_UTF8 && !E.bom;
+  if (exact && unchanged && !E.crlf && st.st_size >= KILO_INPLACE_MIN) {
+    off_t offset = 0;
+    int j;
+    for (j = 0; j < E.mod_row && j < E.numrows; j++) offset += E.row[j].size + 1;
+    if (E.mod_row < E.numrows) {
+      offset += E.mod_col < E.row[E.mod_row].size ? E.mod_col : E.row[E.mod_row].size;
+    }
+    if (offset <= st.st_size) {
+      job->inplace = 1;
+      job->offset = offset;
+    }
+  }
+
+  if (job->inplace) {
+    // Only copy the rows from the first modification onward
+    int from = E.mod_row < E.numrows ? E.mod_row : E.numrows;
+    int col = 0;
+    if (from < E.numrows) col = E.mod_col < E.row[from].size ? E.mod_col : E.row[from].size;
+    size_t len = 0;
+    int j;
+    for (j = from; j < E.numrows; j++) len += E.row[j].size + 1;
+    len -= col;
+    job->buf = malloc(len ? len : 1);
+    char *p = job->buf;
+    for (j = from; j < E.numrows; j++) {
+      int skip = (j == from) ? col : 0;
+      memcpy(p, &E.row[j].chars[skip], E.row[j].size - skip);
+      p += E.row[j].size - skip;
+      *p++ = '\n';
+    }
+    job->len = len;
+    // Rows keep their offsets, the ones after the first change move
+    off_t out = 0;
+    for (j = 0; j < E.numrows; j++) {
+      E.row[j].save_off = out;
+      out += E.row[j].size + 1;
+    }
+  } else if (exact && unchanged && (job->srcfd = open(job->path, O_RDONLY)) != -1) {
+    editorSnapshotExtents(job);
+  } else {
+    // Change row to string, the thread only ever sees this snapshot
+    job->buf = editorRowsToString(&job->len);
+    if (!exact) {
+      size_t lost;
+      char *enc = editorEncode(E.encoding, E.bom, job->buf, job->len, &job->len, &lost);
+      free(job->buf);
+      job->buf = enc;
+      if (lost) editorSetStatusMessage("%zu characters can't be written as %s, saved as '?'", lost,
+        editorEncodingName(E.encoding));
+    }
+    off_t out = 0;
+    int j;
+    for (j = 0; j < E.numrows; j++) {
+      E.row[j].save_off = out;
+      out += E.row[j].size + 1;
+    }
+  }
+  E.mod_row = E.numrows + 1;
+  E.mod_col = 0;
+  job->journal_mark = E.journal.total;
+  job->undo_end = E.undo.end;
+  job->undo_group = E.undo.group;
+  job->hash = E.doc_hash;
+  job->rows = E.numrows;
+  job->written = 0;
+  job->shown = -1;
+  job->done = 0;
+  job->err = 0;
+  job->dirty = E.dirty;
+
+  if (pthread_create(&job->thread, NULL, editorSaveThread, job) != 0) {
+    editorSetStatusMessage("Can't save! %s", strerror(errno));
+    free(job->buf);
+    free(job->path);
+    job->buf = NULL;
+    job->path = NULL;
+    return;
+  }
+  job->active = 1;
+  editorSetStatusMessage("Saving %s...", job->path);
+}
+
+/*** journal ***/
+
+// Journal for a file lives next to it as .<name>.gram-journal
+char *editorJournalPath(const char *filename) {
+  const char *slash = strrchr(filename, '/');
+  int dirlen = slash ? slash - filename + 1 : 0;
+  char *path = malloc(strlen(filename) + 16);
+  sprintf(path, "%.*s.%s.gram-journal", dirlen, filename, slash ? slash + 1 : filename);
+  return path;
+}
+
+void editorJournalHeader(struct journalHeader *h) {
+  memset(h, 0, sizeof(*h));
+  memcpy(h->magic, KILO_JOURNAL_MAGIC, sizeof(h->magic));
+  h->size = E.disk.st_size;
+  h->mtime_sec = E.disk.st_mtim.tv_sec;
+  h->mtime_nsec = E.disk.st_mtim.tv_nsec;
+  h->ino = E.disk.st_ino;
+}
+
+// Add a record to the in-memory batch, the thread makes it durable on its next commit
+void editorJournalRecord(int op, int row, int at, const char *s, size_t len) {
+  struct editorJournal *j = &E.journal;
+  if (!j->running || j->replaying) return;
+
+  struct journalRecord rec = { op, row, at, len };
+  pthread_mutex_lock(&j->lock);
+  if (j->len + sizeof(rec) + len > j->cap) {
+    j->cap = (j->len + sizeof(rec) + len) * 2;
+    j->buf = realloc(j->buf, j->cap);
+  }
+  memcpy(&j->buf[j->len], &rec, sizeof(rec));
+  if (len) memcpy(&j->buf[j->len + sizeof(rec)], s, len);
+  j->len += sizeof(rec) + len;
+  j->total += sizeof(rec) + len;
+  pthread_mutex_unlock(&j->lock);
+}
+
+// Replace the journal with a new header and the records from position reset onward
+int editorJournalCompact(struct editorJournal *j, long long reset, struct journalHeader *h) {
+  char *tmp = malloc(strlen(j->path) + 8);
+  sprintf(tmp, "%s.new", j->path);
+  // Read and write, it becomes the journal the next compaction copies from
+  int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  int ok = fd != -1 && write(fd, h, sizeof(*h)) == sizeof(*h);
+
+  // Records made after the snapshot are already in the old file, carry them over
+  off_t from = sizeof(*h) + (reset - j->file_start);
+  char chunk[4096];
+  ssize_t n;
+  while (ok && (n = pread(j->fd, chunk, sizeof(chunk), from)) != 0) {
+    // A failed read would lose the records, keep the old journal instead
+    if (n == -1) {
+      ok = errno == EINTR;
+      continue;
+    }
+    ok = write(fd, chunk, n) == n;
+    from += n;
+  }
+  if (ok && fdatasync(fd) == 0 && rename(tmp, j->path) == 0) {
+    close(j->fd);
+    j->fd = fd;
+    j->file_start = reset;
+  } else {
+    if (fd != -1) close(fd);
+    unlink(tmp);
+    ok = 0;
+  }
+  free(tmp);
+  return ok;
+}
+
+// Group commit loop: collect records for a while, then write and flush them together
+void *editorJournalThread(void *arg) {
+  struct editorJournal *j = arg;
+  char *batch = NULL;
+  size_t batchcap = 0;
+
+  pthread_mutex_lock(&j->lock);
+  while (1) {
+    if (!j->stop) {
+      struct timespec ts;
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_nsec += KILO_JOURNAL_MS * 1000000L;
+      ts.tv_sec += ts.tv_nsec / 1000000000L;
+      ts.tv_nsec %= 1000000000L;
+      pthread_cond_timedwait(&j->cond, &j->lock, &ts);
+    }
+
+    // Swap the batch out so the editor can keep recording while we write
+    char *tmp = j->buf;
+    size_t tmpcap = j->cap;
+    size_t len = j->len;
+    j->buf = batch;
+    j->cap = batchcap;
+    j->len = 0;
+    batch = tmp;
+    batchcap = tmpcap;
+    long long reset = j->reset;
+    struct journalHeader h = j->base;
+    j->reset = -1;
+    int stop = j->stop;
+    pthread_mutex_unlock(&j->lock);
+
+    int flush = 0;
+    if (len) {
+      size_t off = 0;
+      while (off < len) {
+        ssize_t w = write(j->fd, batch + off, len - off);
+        if (w == -1 && errno == EINTR) continue;
+        if (w <= 0) break;
+        off += w;
+      }
+      j->file_end += len;
+      flush = 1;
+    }
+    if (reset != -1) editorJournalCompact(j, reset, &h);
+    if (flush) fdatasync(j->fd);
+
+    pthread_mutex_lock(&j->lock);
+    if (stop) break;
+  }
+  pthread_mutex_unlock(&j->lock);
+  free(batch);
+  return NULL;
+}
+
+// Ask the thread to drop records that the file on disk now contains
+void editorJournalReset(long long mark) {
+  struct editorJournal *j = &E.journal;
+  pthread_mutex_lock(&j->lock);
+  j->reset = mark;
+  editorJournalHeader(&j->base);
+  pthread_cond_signal(&j->cond);
+  pthread_mutex_unlock(&j->lock);
+}
+
+void editorJournalLaunch() {
+  struct editorJournal *j = &E.journal;
+  j->stop = 0;
+  j->reset = -1;
+  j->len = 0;
+  // Records already in the file, replayed ones included, count as appended so a
+  // save's compaction drops them along with the rest
+  j->file_start = 0;
+  j->file_end = lseek(j->fd, 0, SEEK_END) - sizeof(struct journalHeader);
+  j->total = j->file_end;
+  if (pthread_create(&j->thread, NULL, editorJournalThread, j) != 0) {
+    close(j->fd);
+    j->fd = -1;
+    return;
+  }
+  j->running = 1;
+}
+
+// Start an empty journal for the current file
+void editorJournalStart() {
+  struct editorJournal *j = &E.journal;
+  if (j->running || E.filename == NULL || !E.disk_valid || E.batch.active) return;
+  free(j->path);
+  j->path = editorJournalPath(E.filename);
+  j->fd = open(j->path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (j->fd == -1) return;
+
+  struct journalHeader h;
+  editorJournalHeader(&h);
+  if (write(j->fd, &h, sizeof(h)) != sizeof(h) || fdatasync(j->fd) == -1) {
+    close(j->fd);
+    unlink(j->path);
+    j->fd = -1;
+    return;
+  }
+  editorJournalLaunch();
+}
+
+// Flush the remaining records and stop the thread, removing the journal if asked
+void editorJournalStop(int discard) {
+  struct editorJournal *j = &E.journal;
+  if (!j->running) return;
+  pthread_mutex_lock(&j->lock);
+  j->stop = 1;
+  pthread_cond_signal(&j->cond);
+  pthread_mutex_unlock(&j->lock);
+  pthread_join(j->thread, NULL);
+  j->running = 0;
+  close(j->fd);
+  j->fd = -1;
+  if (discard) unlink(j->path);
+}
+
+// Apply the records of a journal found at startup, returns number of records replayed
+// and sets used to the bytes they take up
+int editorJournalReplay(char *data, size_t len, size_t *used) {
+  struct journalRecord rec;
+  size_t off = 0;
+  int count = 0;
+  *used = 0;
+  E.journal.replaying = 1;
+  while (off + sizeof(rec) <= len) {
+    memcpy(&rec, &data[off], sizeof(rec));
+    char *text = &data[off + sizeof(rec)];
+    // A crash can leave a torn record at the end
+    if (off + sizeof(rec) + rec.len > len) break;
+    off += sizeof(rec) + rec.len;
+
+    int row = rec.row;
+    if (rec.op != J_INSERT_ROW && rec.op != J_INSERT_ROWS && row >= E.numrows) break;
+    switch (rec.op) {
+      case J_INSERT_ROW: editorInsertRow(row, text, rec.len); break;
+      case J_DEL_ROW: editorDelRow(row); break;
+      case J_INSERT: editorRowInsertString(&E.row[row], rec.at, text, rec.len); break;
+      case J_APPEND: editorRowAppendString(&E.row[row], text, rec.len); break;
+      case J_DEL_CHAR: editorRowDelChar(&E.row[row], rec.at); break;
+      case J_DELETE: editorRowDelChars(&E.row[row], rec.at, rec.len); break;
+      case J_TRUNCATE: editorRowTruncate(&E.row[row], rec.at); break;
+      // Block edits are recorded for undo by whoever makes them, so here too
+      case J_INSERT_ROWS:
+        editorInsertRowsEdit(row, text, rec.len);
+        editorUndoAdd(U_INSERT, row, 0, editorUndoText(text, rec.len), rec.len);
+        break;
+      case J_DEL_ROWS: {
+        int n = (int)rec.at < E.numrows - row ? (int)rec.at : E.numrows - row;
+        size_t glen;
+        char *gone = editorRowsText(row, n, &glen);
+        editorDelRowsEdit(row, n);
+        editorUndoAdd(U_DELETE, row, 0, gone, glen);
+        break;
+      }
+      default: off = len; continue;
+    }
+    count++;
+    *used = off;
+  }
+  E.journal.replaying = 0;
+  return count;
+}
+
+// Look for a journal left behind by a session that didn't exit cleanly
+void editorJournalRecover() {
+  struct editorJournal *j = &E.journal;
+  if (E.filename == NULL || !E.disk_valid) return;
+  char *path = editorJournalPath(E.filename);
+  int fd = open(path, O_RDWR);
+  if (fd == -1) {
+    free(path);
+    editorJournalStart();
+    return;
+  }
+
+  struct stat st;
+  struct journalHeader h, cur;
+  editorJournalHeader(&cur);
+  int usable = fstat(fd, &st) == 0 && st.st_size > (off_t)sizeof(h) &&
+               pread(fd, &h, sizeof(h), 0) == sizeof(h) && !memcmp(&h, &cur, sizeof(h));
+  if (usable && editorConfirm("Recovery journal found for %s. Replay unsaved edits? (y/n)", E.filename)) {
+    size_t len = st.st_size - sizeof(h);
+    char *data = malloc(len);
+    size_t used = 0;
+    if (pread(fd, data, len, sizeof(h)) == (ssize_t)len) {
+      int n = editorJournalReplay(data, len, &used);
+      editorSetStatusMessage("Replayed %d edits from the recovery journal", n);
+    }
+    free(data);
+    // Drop a torn or unusable tail, new records have to follow straight on
+    if (ftruncate(fd, sizeof(h) + used) == -1) {
+      close(fd);
+      free(path);
+      editorJournalStart();
+      return;
+    }
+    // Keep appending to the replayed journal, the file still lacks these edits
+    free(j->path);
+    j->path = path;
+    j->fd = fd;
+    editorJournalLaunch();
+    return;
+  }
+  close(fd);
+  free(path);
+  editorJournalStart();
+}
+
+/*** streaming input ***/
+
+// Give rows first onward, just inserted from src, their offsets in the file
+void editorNoteOffsets(struct lineSplitter *ls, int first, char *src) {
+  if (ls->off == -1) return;
+  for (int j = first; j < E.numrows; j++) {
+    erow *row = &E.row[j];
+    // Rows can only be copied back by a save if they are stored exactly as they will be written
+    int exact = src[row->size] == '\n';
+    size_t disklen = row->size + (exact ? 1 : 2);
+    row->off = exact ? ls->off : -1;
+    if (!exact) E.crlf = 1;
+    ls->off += disklen;
+    src += disklen;
+  }
+}
+
+// Append the complete lines in buf as rows, holding back a trailing partial line
+void editorAppendLines(struct lineSplitter *ls, char *buf, size_t len) {
+  char *last = memrchr(buf, '\n', len);
+  size_t complete = last ? (size_t)(last - buf + 1) : 0;
+  if (last && ls->plen) {
+    // Finish the held back line first
+    char *nl = memchr(buf, '\n', len);
+    size_t head = nl - buf + 1;
+    if (ls->plen + head > ls->pcap) {
+      ls->pcap = (ls->plen + head) * 2;
+      ls->partial = realloc(ls->partial, ls->pcap);
+    }
+    memcpy(&ls->partial[ls->plen], buf, head);
+    int first = E.numrows;
+    editorInsertRows(E.numrows, ls->partial, ls->plen + head);
+    editorNoteOffsets(ls, first, ls->partial);
+    ls->plen = 0;
+    buf += head;
+    len -= head;
+    complete -= head;
+  }
+  int first = E.numrows;
+  editorInsertRows(E.numrows, buf, complete);
+  editorNoteOffsets(ls, first, buf);
+
+  // Keep the tail in the partial line buffer
+  len -= complete;
+  if (ls->plen + len > ls->pcap) {
+    ls->pcap = (ls->plen + len) * 2;
+    ls->partial = realloc(ls->partial, ls->pcap);
+  }
+  memcpy(&ls->partial[ls->plen], buf + complete, len);
+  ls->plen += len;
+}
+
+// Append text in the splitter's encoding, converting it to UTF-8 first
+void editorAppendText(struct lineSplitter *ls, char *buf, size_t len) {
+  if (ls->enc == ENC_UTF8) {
+    editorAppendLines(ls, buf, len);
+    return;
+  }
+  // Bytes held back from the last call come first
+  unsigned char *in = (unsigned char *)buf;
+  if (ls->ncarry) {
+    in = malloc(ls->ncarry + len);
+    memcpy(in, ls->carry, ls->ncarry);
+    memcpy(in + ls->ncarry, buf, len);
+    len += ls->ncarry;
+  }
+  if (2 * len > ls->deccap) {
+    ls->deccap = 2 * len;
+    ls->dec = realloc(ls->dec, ls->deccap);
+  }
+  size_t used;
+  size_t n = editorDecode(ls->enc, in, len, ls->dec, &used);
+  ls->ncarry = len - used;
+  memcpy(ls->carry, in + used, ls->ncarry);
+  if (in != (unsigned char *)buf) free(in);
+  editorAppendLines(ls, ls->dec, n);
+}
+
+// Input ended, the held back text becomes the last row
+void editorFlushText(struct lineSplitter *ls) {
+  // Half a character left over, show that something was there
+  if (ls->ncarry) {
+    ls->ncarry = 0;
+    editorAppendLines(ls, "\xef\xbf\xbd", 3);
+  }
+  if (ls->plen == 0) return;
+  if (ls->plen + 1 > ls->pcap) {
+    ls->pcap = ls->plen + 1;
+    ls->partial = realloc(ls->partial, ls->pcap);
+  }
+  ls->partial[ls->plen++] = '\n';
+  editorInsertRows(E.numrows, ls->partial, ls->plen);
+  ls->plen = 0;
+}
+
+// Ask for the next piece of the file into a chunk that has been turned into rows
+void editorLoadSubmit(struct editorStream *st, struct loadChunk *c) {
+  c->ready = 0;
+  c->got = 0;
+  c->len = 0;
+  if (st->next >= st->size) return;
+  c->off = st->next;
+  c->len = st->size - st->next < KILO_SAVE_CHUNK ? (size_t)(st->size - st->next) : KILO_SAVE_CHUNK;
+  st->next += c->len;
+  ioSubmit(&st->io, IO_READ, st->fd, c->buf, c->len, c->off, c);
+}
+
+// Turn the chunks that have arrived into rows, in file order, and ask for more.
+// Returns the number of bytes added
+size_t editorLoadTake(struct editorStream *st, int *eof, int *err) {
+  struct ioCompletion done[KILO_IO_DEPTH];
+  int n = ioReap(&st->io, done, KILO_IO_DEPTH, 0);
+  for (int i = 0; i < n; i++) {
+    struct loadChunk *c = done[i].data;
+    ssize_t r = done[i].res;
+    if (r < 0) {
+      st->err = -r;
+      continue;
+    }
+    c->got += r;
+    if (r == 0) {
+      // File got shorter since it was opened
+      if (c->off + (off_t)c->got < st->size) st->size = c->off + c->got;
+      c->ready = 1;
+    } else if (c->got < c->len) {
+      ioSubmit(&st->io, IO_READ, st->fd, c->buf + c->got, c->len - c->got, c->off + c->got, c);
+    } else {
+      c->ready = 1;
+    }
+  }
+
+  size_t added = 0;
+  int more = 1;
+  while (more && !st->err) {
+    more = 0;
+    for (int i = 0; i < KILO_IO_DEPTH; i++) {
+      struct loadChunk *c = &st->chunk[i];
+      if (!c->ready || !c->len || c->off != st->appended) continue;
+      editorAppendText(&st->lines, c->buf, c->got);
+      st->appended += c->got;
+      added += c->got;
+      editorLoadSubmit(st, c);
+      more = 1;
+    }
+  }
+  ioFlush(&st->io);
+  *err = st->err;
+  *eof = st->err || st->appended >= st->size;
+  return added;
+}
+
+// Read the input on a thread so a slow or huge producer never blocks the editor
+void *editorStreamThread(void *arg) {
+  struct editorStream *st = arg;
+  char *chunk = malloc(KILO_SAVE_CHUNK);
+  while (1) {
+    ssize_t n = read(st->fd, chunk, KILO_SAVE_CHUNK);
+    if (n == -1 && errno == EINTR) continue;
+
+    pthread_mutex_lock(&st->lock);
+    if (n <= 0) {
+      st->eof = 1;
+      st->err = n == -1 ? errno : 0;
+      pthread_mutex_unlock(&st->lock);
+      break;
+    }
+    // Don't run ahead of the editor by more than a few batches
+    while (st->len >= KILO_STREAM_AHEAD) pthread_cond_wait(&st->cond, &st->lock);
+    if (st->len + n > st->cap) {
+      st->cap = (st->len + n) * 2;
+      st->buf = realloc(st->buf, st->cap);
+    }
+    memcpy(&st->buf[st->len], chunk, n);
+    st->len += n;
+    pthread_mutex_unlock(&st->lock);
+  }
+  free(chunk);
+  return NULL;
+}
+
+// Start reading rows from fd in the background
+void editorStreamOpen(int fd, const char *name, off_t size) {
+  struct editorStream *st = &E.stream;
+  st->fd = fd;
+  st->name = strdup(name);
+  st->buf = NULL;
+  st->len = 0;
+  st->cap = 0;
+  st->eof = 0;
+  st->err = 0;
+  st->total = 0;
+  st->size = size;
+  st->loading = size > 0;
+  if (!st->loading) st->lines.off = -1;
+  clock_gettime(CLOCK_MONOTONIC, &st->shown);
+  st->async = st->loading;
+  if (st->async) {
+    // Size is known, so ask for the next few chunks at once and let them arrive in any order
+    st->next = st->appended = lseek(fd, 0, SEEK_CUR);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    ioQueueInit(&st->io, KILO_IO_DEPTH);
+    for (int i = 0; i < KILO_IO_DEPTH; i++) {
+      st->chunk[i].buf = malloc(KILO_SAVE_CHUNK);
+      editorLoadSubmit(st, &st->chunk[i]);
+    }
+    ioFlush(&st->io);
+  } else {
+    pthread_mutex_init(&st->lock, NULL);
+    pthread_cond_init(&st->cond, NULL);
+    if (pthread_create(&st->thread, NULL, editorStreamThread, st) != 0) die("pthread_create");
+  }
+  st->active = 1;
+  editorSetStatusMessage("%s %s...", st->loading ? "Loading" : "Reading", name);
+}
+
+// Turn whatever the thread has read into rows, returns 1 if rows were added
+int editorPollStream() {
+  struct editorStream *st = &E.stream;
+  if (!st->active) return 0;
+
+  char *buf = NULL;
+  size_t len;
+  int eof, err;
+  if (st->async) {
+    len = editorLoadTake(st, &eof, &err);
+  } else {
+    pthread_mutex_lock(&st->lock);
+    buf = st->buf;
+    len = st->len;
+    eof = st->eof;
+    err = st->err;
+    st->buf = NULL;
+    st->len = 0;
+    st->cap = 0;
+    pthread_cond_signal(&st->cond);
+    pthread_mutex_unlock(&st->lock);
+  }
+
+  E.busy = len > 0;
+  if (len) {
+    // Keep the cursor on the last line if it was there before
+    int at_end = !st->loading && E.numrows > 0 && E.cy >= E.numrows - 1;
+    size_t skip = 0;
+    if (buf && st->total == 0) {
+      // Nothing to look at before the first data arrives, so pipes are detected here
+      E.encoding = st->lines.enc = editorDetectEncoding((unsigned char *)buf, len, &skip);
+      E.bom = skip;
+    }
+    if (buf) editorAppendText(&st->lines, buf + skip, len - skip);
+    st->total += len;
+    if (at_end) E.cy = E.numrows - 1;
+    if (st->loading) {
+      editorSetStatusMessage("Loading %s... %d%%", st->name, (int)(st->total * 100 / st->size));
+    } else {
+      editorSetStatusMessage("Reading %s... %zu KB", st->name, st->total / 1024);
+    }
+  }
+  free(buf);
+  if (!eof) {
+    // Rows keep arriving in quick batches, only redraw a few times a second
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long ms = (now.tv_sec - st->shown.tv_sec) * 1000 + (now.tv_nsec - st->shown.tv_nsec) / 1000000;
+    if (!len || ms < 100) return 0;
+    st->shown = now;
+    return 1;
+  }
+
+  // Input is done, the held back partial line is the last row
+  if (st->async) {
+    ioQueueFree(&st->io);
+    for (int i = 0; i < KILO_IO_DEPTH; i++) free(st->chunk[i].buf);
+    st->async = 0;
+  } else {
+    pthread_join(st->thread, NULL);
+  }
+  editorFlushText(&st->lines);
+  close(st->fd);
+  st->active = 0;
+  E.busy = 0;
+  if (err) editorSetStatusMessage("Error reading %s: %s", st->name, strerror(err));
+  else editorSetStatusMessage("%s %zu bytes from %s", st->loading ? "Loaded" : "Read", st->total, st->name);
+  if (st->loading) {
+    st->loading = 0;
+    editorLoadComplete();
+  }
+  return 1;
+}
+
+/*** follow mode ***/
+
+// Turn appended bytes into rows, dropping the oldest rows past the cap
+void editorFollowFeed(char *buf, size_t len) {
+  // Keep the cursor on the last line if it was there before
+  int at_end = E.cy >= E.numrows - 1;
+  int before = E.numrows;
+  editorAppendText(&E.follow.lines, buf, len);
+  if (E.numrows == before) return;
+
+  // Drop the oldest rows in one go once over the cap
+  if (E.numrows > KILO_FOLLOW_MAXROWS) {
+    int n = E.numrows - KILO_FOLLOW_MAXROWS;
+    editorDelRows(0, n);
+    E.cy = E.cy > n ? E.cy - n : 0;
+    E.rowoff = E.rowoff > n ? E.rowoff - n : 0;
+  }
+  if (at_end) {
+    E.cy = E.numrows - 1;
+    E.cx = 0;
+  }
+}
+
+// Read everything appended since the last call, up to the per-frame budget
+int editorFollowRead() {
+  struct editorFollow *f = &E.follow;
+  struct stat st;
+  if (fstat(f->fd, &st) == -1) return 0;
+  if (st.st_size < f->pos) {
+    // Truncated in place (copytruncate rotation), start over from the top
+    f->pos = E.bom;
+    f->lines.plen = 0;
+    f->lines.ncarry = 0;
+    editorSetStatusMessage("%s truncated", E.filename);
+  }
+  f->behind = 0;
+  if (st.st_size == f->pos) return 0;
+
+  size_t chunk = KILO_SAVE_CHUNK;
+  char *buf = malloc(chunk);
+  size_t total = 0;
+  ssize_t n;
+  while (total < KILO_FOLLOW_BUDGET && (n = pread(f->fd, buf, chunk, f->pos)) > 0) {
+    f->pos += n;
+    total += n;
+    editorFollowFeed(buf, n);
+  }
+  free(buf);
+  // No inotify event comes for bytes already written, so keep polling until caught up
+  f->behind = f->pos < st.st_size;
+  E.busy = f->behind;
+  E.dirty = 0; // Rows mirror the file, nothing to save
+  return total > 0;
+}
+
+// (Re)open the followed file and watch it for appends and rotation
+int editorFollowWatch() {
+  struct editorFollow *f = &E.follow;
+  if (f->fd != -1) close(f->fd);
+  f->fd = open(E.filename, O_RDONLY);
+  if (f->fd == -1) return -1;
+  if (f->wd != -1) inotify_rm_watch(f->ifd, f->wd);
+  f->wd = inotify_add_watch(f->ifd, E.filename, IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF | IN_ATTRIB);
+  return 0;
+}
+
+// Open only the tail of filename and keep appending rows as it grows
+void editorFollowOpen(char *filename) {
+  struct editorFollow *f = &E.follow;
+  free(E.filename);
+  E.filename = strdup(filename);
+  editorSelectSyntaxHighlight();
+
+  f->ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (f->ifd == -1) die("inotify_init1");
+  if (editorFollowWatch() == -1) die("open");
+  f->active = 1;
+  E.readonly = 1;
+
+  struct stat st;
+  if (fstat(f->fd, &st) == -1) die("fstat");
+  unsigned char head[4096];
+  ssize_t got = pread(f->fd, head, sizeof(head), 0);
+  size_t bom;
+  E.encoding = f->lines.enc = editorDetectEncoding(head, got > 0 ? got : 0, &bom);
+  E.bom = bom;
+  int unit = E.encoding == ENC_UTF16LE || E.encoding == ENC_UTF16BE ? 2 : 1;
+  f->pos = st.st_size > KILO_FOLLOW_TAIL ? st.st_size - KILO_FOLLOW_TAIL : 0;
+  if (f->pos > 0) {
+    // Skip the line we landed in the middle of, a code unit at a time
+    f->pos -= (f->pos - bom) % unit;
+    int nlbyte = E.encoding == ENC_UTF16BE;
+    unsigned char c[2];
+    while (pread(f->fd, c, unit, f->pos) == unit) {
+      f->pos += unit;
+      if (c[unit == 2 ? nlbyte : 0] == '\n' && (unit == 1 || c[!nlbyte] == 0)) break;
+    }
+  } else {
+    f->pos = bom;
+  }
+  editorFollowRead();
+  E.cy = E.numrows ? E.numrows - 1 : 0;
+}
+
+// Drain inotify events and pick up new data, returns 1 if rows were added
+int editorPollFollow() {
+  struct editorFollow *f = &E.follow;
+  if (!f->active) return 0;
+
+  char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t len;
+  int changed = 0, reopen = 0;
+  while ((len = read(f->ifd, events, sizeof(events))) > 0) {
+    char *p = events;
+    while (p < events + len) {
+      struct inotify_event *ev = (struct inotify_event *)p;
+      if (ev->mask & (IN_MOVE_SELF | IN_DELETE_SELF)) reopen = 1;
+      changed = 1;
+      p += sizeof(struct inotify_event) + ev->len;
+    }
+  }
+  if (!changed && !f->behind) return 0;
+
+  // Drain what is left of the old file, then switch to the new one at the same path
+  int redraw = editorFollowRead();
+  if (reopen && access(E.filename, F_OK) == 0 && editorFollowWatch() == 0) {
+    f->pos = E.bom;
+    f->lines.plen = 0;
+    f->lines.ncarry = 0;
+    editorSetStatusMessage("%s was rotated, following the new file", E.filename);
+    redraw |= editorFollowRead();
+  }
+  return redraw;
+}
+
+/*** external changes ***/
+
+// Start watching the directory of the open file, which also catches replacement by rename
+void editorWatchStart() {
+  struct editorWatch *w = &E.watch;
+  if (E.filename == NULL || E.follow.active) return;
+  if (w->ifd == -1) w->ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (w->ifd == -1) return;
+  if (w->wd != -1) inotify_rm_watch(w->ifd, w->wd);
+
+  char *slash = strrchr(E.filename, '/');
+  char *dir = slash ? strndup(E.filename, slash == E.filename ? 1 : slash - E.filename) : strdup(".");
+  free(w->name);
+  w->name = strdup(slash ? slash + 1 : E.filename);
+  w->wd = inotify_add_watch(w->ifd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+  free(dir);
+}
+
+// Line of the file being reloaded
+struct diskLine {
+  char *s;
+  int len;
+  uint64_t hash;
+};
+
+int editorRowMatches(erow *row, struct diskLine *l) {
+  return row->hash == l->hash && row->size == l->len && !memcmp(row->chars, l->s, l->len);
+}
+
+// Replace count old rows at at with the given lines, reusing rows when counts match
+void editorReloadHunk(int at, int count, struct diskLine *lines, int n) {
+  if (count == n) {
+    for (int j = 0; j < n; j++) {
+      erow *row = &E.row[at + j];
+      if (editorRowMatches(row, &lines[j])) continue;
+      editorRowOwn(row);
+      row->chars = realloc(row->chars, lines[j].len + 1);
+      memcpy(row->chars, lines[j].s, lines[j].len);
+      row->chars[lines[j].len] = '\0';
+      row->size = lines[j].len;
+      editorUpdateRow(row);
+    }
+    return;
+  }
+
+  editorDelRows(at, count);
+  size_t len = 0;
+  for (int j = 0; j < n; j++) len += lines[j].len + 1;
+  char *buf = malloc(len ? len : 1), *p = buf;
+  for (int j = 0; j < n; j++) {
+    memcpy(p, lines[j].s, lines[j].len);
+    p[lines[j].len] = '\n';
+    p += lines[j].len + 1;
+  }
+  editorInsertRows(at, buf, len);
+  free(buf);
+
+  // Keep the cursor on the same text when rows before it came or went
+  if (E.cy >= at + count) E.cy += n - count;
+  else if (E.cy >= at + n) E.cy = at + n;
+  if (E.rowoff >= at + count) E.rowoff += n - count;
+}
+
+// Bring the rows in line with the file on disk, touching only lines that differ.
+// Returns the number of rows replaced, inserted or deleted, or -1 on error
+int editorReloadChanged() {
+  int fd = open(E.filename, O_RDONLY);
+  if (fd == -1) return -1;
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    return -1;
+  }
+  char *map = st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+  close(fd);
+  if (st.st_size && map == MAP_FAILED) return -1;
+
+  // The file may have been rewritten in another encoding, anything but plain UTF-8 is converted whole
+  size_t bom;
+  E.encoding = editorDetectEncoding((unsigned char *)map, st.st_size < KILO_FIRST_SCREEN ? st.st_size : KILO_FIRST_SCREEN, &bom);
+  E.bom = bom;
+  int plain = E.encoding == ENC_UTF8 && !bom;
+  char *text = map;
+  size_t tlen = st.st_size;
+  if (!plain) text = editorDecodeAll(E.encoding, (unsigned char *)map + bom, st.st_size - bom, &tlen);
+  char *end = text + tlen;
+
+  // Common prefix, compared in place without building an index
+  int pre = 0;
+  char *p = text;
+  while (p < end && pre < E.numrows) {
+    char *nl = memchr(p, '\n', end - p);
+    int len = (nl ? nl : end) - p;
+    if (len > 0 && p[len - 1] == '\r') len--;
+    if (E.row[pre].size != len || memcmp(E.row[pre].chars, p, len)) break;
+    pre++;
+    p = nl ? nl + 1 : end;
+  }
+
+  // Index and hash only the lines after the prefix
+  int n = 0, cap = 1024;
+  struct diskLine *lines = malloc(sizeof(struct diskLine) * cap);
+  while (p < end) {
+    char *nl = memchr(p, '\n', end - p);
+    int len = (nl ? nl : end) - p;
+    if (len > 0 && p[len - 1] == '\r') len--;
+    if (n == cap) {
+      cap *= 2;
+      lines = realloc(lines, sizeof(struct diskLine) * cap);
+    }
+    lines[n].s = p;
+    lines[n].len = len;
+    lines[n].hash = editorHash(p, len);
+    n++;
+    p = nl ? nl + 1 : end;
+  }
+
+  // Common suffix
+  int oldn = E.numrows - pre;
+  int suf = 0;
+  while (suf < n && suf < oldn && editorRowMatches(&E.row[E.numrows - 1 - suf], &lines[n - 1 - suf])) suf++;
+  oldn -= suf;
+  n -= suf;
+
+  // Walk the middle, resynchronising on matching hashes after each difference
+  int hunks = 0, hcap = 16;
+  int (*hunk)[4] = malloc(sizeof(*hunk) * hcap);
+  int i = 0, j = 0;
+  while (i < oldn || j < n) {
+    if (i < oldn && j < n && editorRowMatches(&E.row[pre + i], &lines[j])) {
+      i++;
+      j++;
+      continue;
+    }
+    int di = oldn - i, dj = n - j;
+    for (int k = 1; k <= KILO_RESYNC_WINDOW; k++) {
+      if (i + k < oldn && j < n && editorRowMatches(&E.row[pre + i + k], &lines[j])) { di = k; dj = 0; break; }
+      if (j + k < n && i < oldn && editorRowMatches(&E.row[pre + i], &lines[j + k])) { di = 0; dj = k; break; }
+      if (i + k < oldn && j + k < n && editorRowMatches(&E.row[pre + i + k], &lines[j + k])) { di = k; dj = k; break; }
+    }
+    if (hunks == hcap) {
+      hcap *= 2;
+      hunk = realloc(hunk, sizeof(*hunk) * hcap);
+    }
+    hunk[hunks][0] = pre + i;
+    hunk[hunks][1] = di;
+    hunk[hunks][2] = j;
+    hunk[hunks][3] = dj;
+    hunks++;
+    i += di;
+    j += dj;
+  }
+
+  // Apply from the bottom so earlier row numbers stay valid
+  int changed = 0;
+  for (int h = hunks - 1; h >= 0; h--) {
+    editorReloadHunk(hunk[h][0], hunk[h][1], &lines[hunk[h][2]], hunk[h][3]);
+    changed += hunk[h][1] > hunk[h][3] ? hunk[h][1] : hunk[h][3];
+  }
+  free(hunk);
+  free(lines);
+
+  // Every row now matches the file, so all of them can be copied by the next save
+  off_t off = 0;
+  E.crlf = 0;
+  p = text;
+  for (int r = 0; r < E.numrows && p < end; r++) {
+    char *nl = memchr(p, '\n', end - p);
+    size_t disklen = (nl ? nl + 1 : end) - p;
+    int exact = nl && disklen == (size_t)E.row[r].size + 1;
+    if (nl && !exact) E.crlf = 1;
+    E.row[r].off = exact && plain ? off : -1;
+    off += disklen;
+    p += disklen;
+  }
+  if (!plain) free(text);
+  if (map) munmap(map, st.st_size);
+
+  if (E.cy > E.numrows) E.cy = E.numrows;
+  if (E.rowoff > E.cy) E.rowoff = E.cy;
+  E.disk = st;
+  E.disk_valid = 1;
+  E.dirty = 0;
+  E.mod_row = E.numrows + 1;
+  E.mod_col = 0;
+  E.watch.conflict = 0;
+  // The rows were changed underneath the history, so it no longer applies
+  editorUndoClear();
+  editorMarkSaved(E.doc_hash);
+  if (E.journal.running) editorJournalReset(E.journal.total);
+  return changed;
+}
+
+// Reload on request, throwing away unsaved changes
+void editorReload() {
+  if (E.filename == NULL) return;
+  if (E.dirty && !editorConfirm("Discard unsaved changes and reload %s? (y/n)", E.filename)) {
+    editorSetStatusMessage("");
+    return;
+  }
+  int changed = editorReloadChanged();
+  if (changed == -1) editorSetStatusMessage("Can't reload: %s", strerror(errno));
+  else editorSetStatusMessage("Reloaded %s, %d lines changed", E.filename, changed);
+}
+
+// Check watch events and reload the file if someone else changed it
+int editorPollWatch() {
+  struct editorWatch *w = &E.watch;
+  if (w->ifd == -1) return 0;
+
+  char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t len;
+  while ((len = read(w->ifd, events, sizeof(events))) > 0) {
+    char *p = events;
+    while (p < events + len) {
+      struct inotify_event *ev = (struct inotify_event *)p;
+      if (ev->len && !strcmp(ev->name, w->name)) w->pending = 1;
+      p += sizeof(struct inotify_event) + ev->len;
+    }
+  }
+  // Our own save shows up here too, wait until it has recorded the new file
+  if (!w->pending || E.save.active) return 0;
+  w->pending = 0;
+
+  struct stat st;
+  if (editorDiskUnchanged(E.filename, &st) || stat(E.filename, &st) == -1) return 0;
+  if (E.dirty) {
+    w->conflict = 1;
+    editorSetStatusMessage("%s changed on disk! Ctrl-R reloads and discards your changes", E.filename);
+    return 1;
+  }
+  int changed = editorReloadChanged();
+  if (changed > 0) editorSetStatusMessage("%s changed on disk, %d lines reloaded", E.filename, changed);
+  return 1;
+}
+
+/*** find ***/
+
+void editorFindCallback(char *query, int key) {
+  static int last_match = -1;
+  static int direction = 1;
+
+  static int saved_hl_line; // Saves line to have highlighting restored
+  static char *saved_hl = NULL; // Saves highlighting to restore
+
+  if (saved_hl) {
+    memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
+    free(saved_hl);
+    saved_hl = NULL;
+  }
+
+  // If pressed enter or escape, exit search mode
+  if (key == '\r' || key == '\x1b') {
+    // Index of row the last match was on, -1 of no last match
+    last_match = -1;
+    // Direction of search, 1 is forward, -1 is backward
+    direction = 1;
+    return;
+  } else if (key == ARROW_RIGHT || key == ARROW_DOWN) { // Always search in forward
+    direction = 1;
+  } else if (key == ARROW_LEFT || key == ARROW_UP) { // Unless user asked to search backwards
+    direction = -1;
+  } else { // Only advance if arrow key is pressed
+    last_match = -1;
+    direction = 1;
+  }
+
+  if (last_match == -1) direction = 1;
+  int current = last_match;
+  int i;
+  // Loop through all the rows of file
+  for (i = 0; i < E.numrows; i++) {
+    current += direction;
+    if (current == -1) current = E.numrows - 1;
+    else if (current == E.numrows) current = 0;
+
+    erow *row = &E.row[current];
+    // Check if row contains query string
+    char *match = strstr(row->render, query);
+    // Move cursor to the match
+    if (match) {
+      // Start next match from current point
+      last_match = current;
+      E.cy = current;
+      E.cx = editorRowRxToCx(row, match - row->render);
+      E.cx = match - row->render;
+      E.rowoff = E.numrows;
+
+      saved_hl_line = current;
+      saved_hl = malloc(row->rsize);
+
+      memcpy(saved_hl, row->hl, row->rsize);
+      memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
+      break;
+    }
+  }
+}
+
+void editorFind() {
+  int saved_cx = E.cx;
+  int saved_cy = E.cy;
+  int saved_coloff = E.coloff;
+  int saved_rowoff = E.rowoff;
+
+  char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
+
+  if (query) {
+    free(query);
+    if (E.cy != saved_cy || E.cx != saved_cx) editorJumpPush(saved_cy, saved_cx);
+  } else {
+    E.cx = saved_cx;
+    E.cy = saved_cy;
+    E.coloff = saved_coloff;
+    E.rowoff = saved_rowoff;
+  }
+}
+
+/*** multiple cursors ***/
+
+int editorCursorCmp(const void *a, const void *b) {
+  const struct cursorPos *x = a, *y = b;
+  if (x->cy != y->cy) return x->cy < y->cy ? -1 : 1;
+  return (x->cx > y->cx) - (x->cx < y->cx);
+}
+
+void editorCursorsAdd(int cy, int cx) {
+  struct editorCursors *mc = &E.cursors;
+  if (mc->n == mc->cap) {
+    mc->cap = mc->cap ? mc->cap * 2 : 64;
+    mc->pos = realloc(mc->pos, sizeof(struct cursorPos) * mc->cap);
+  }
+  mc->pos[mc->n].cy = cy;
+  mc->pos[mc->n].cx = cx;
+  mc->n++;
+}
+
+// Put the cursors back in order inside the text, merging any that met, and
+// find the primary one again by E.cx and E.cy. Down to one, it's all E's
+void editorCursorsNormalize() {
+  struct editorCursors *mc = &E.cursors;
+  if (mc->n == 0) return;
+  int n = 0;
+  for (int i = 0; i < mc->n; i++) {
+    struct cursorPos *p = &mc->pos[i];
+    if (p->cy > E.numrows) p->cy = E.numrows;
+    int rowlen = p->cy < E.numrows ? E.row[p->cy].size : 0;
+    if (p->cx > rowlen) p->cx = rowlen;
+  }
+  editorUndoClampCursor();
+  qsort(mc->pos, mc->n, sizeof(struct cursorPos), editorCursorCmp);
+  for (int i = 0; i < mc->n; i++) {
+    if (n > 0 && editorCursorCmp(&mc->pos[n - 1], &mc->pos[i]) == 0) continue;
+    mc->pos[n++] = mc->pos[i];
+  }
+  mc->n = n;
+  struct cursorPos key = { E.cy, E.cx };
+  struct cursorPos *p = bsearch(&key, mc->pos, mc->n, sizeof(struct cursorPos), editorCursorCmp);
+  mc->primary = p ? p - mc->pos : 0;
+  E.cy = mc->pos[mc->primary].cy;
+  E.cx = mc->pos[mc->primary].cx;
+  if (mc->n == 1) mc->n = 0;
+}
+
+// Index of the first cursor on row or after it
+int editorCursorsFrom(int row) {
+  struct editorCursors *mc = &E.cursors;
+  int lo = 0, hi = mc->n;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (mc->pos[mid].cy < row) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+// Screen column of the next cursor other than the primary one on row, -1 once there are no more
+int editorCursorsNextRx(int *i, int row) {
+  struct editorCursors *mc = &E.cursors;
+  if (*i < mc->n && *i == mc->primary) (*i)++;
+  if (*i >= mc->n || mc->pos[*i].cy != row) return -1;
+  erow *r = &E.row[row];
+  int cx = mc->pos[(*i)++].cx;
+  if (cx > r->size) cx = r->size;
+  return E.csv.delim ? editorCsvCxToRx(r, cx) : editorRowCxToRx(r, cx);
+}
+
+// Bytes for the row being built by editorCursorsApply
+void editorCursorsPut(char **buf, size_t *len, size_t *cap, const char *s, size_t n) {
+  if (*len + n > *cap) {
+    *cap = (*len + n) * 2 + 64;
+    *buf = realloc(*buf, *cap);
+  }
+  memcpy(*buf + *len, s, n);
+  *len += n;
+}
+
+// Make the row built so far row o of the document
+void editorCursorsEmit(erow *rows, int o, int inplace, const char *line, size_t len) {
+  erow *row = &rows[o];
+  if (inplace) {
+    editorRowRelease(row);
+  } else {
+    row->idx = o;
+    row->rsize = 0;
+    row->render = NULL;
+    row->hl = NULL;
+    row->hl_open_comment = 0;
+    row->hash = 0;
+    row->fields = NULL;
+    row->nfields = -1;
+    row->share = NULL;
+    row->pending = 0;
+  }
+  row->size = len;
+  row->chars = malloc(len + 1);
+  memcpy(row->chars, line, len);
+  row->chars[len] = '\0';
+  row->off = -1;
+  row->save_off = -1;
+}
+
+// Make one change per cursor, in cursor order, in a single pass over the rows.
+// Each row a change touches is rebuilt once, and rows only move when a line
+// break comes or goes. Journal and undo get the changes one by one from the
+// top, each at its position once those before it are made, which is exactly
+// where it ends up in the rebuilt text
+void editorCursorsApply(struct cursorEdit *ed, int n) {
+  struct editorCursors *mc = &E.cursors;
+  int breaks = 0, joins = 0;
+  for (int i = 0; i < n; i++) {
+    for (int k = 0; k < ed[i].inslen; k++) breaks += ed[i].ins[k] == '\n';
+    if (ed[i].row < E.numrows && ed[i].col + ed[i].del > E.row[ed[i].row].size) joins++;
+  }
+  int inplace = breaks == 0 && joins == 0;
+  erow *old = E.row;
+  int oldn = E.numrows;
+  erow *rows = inplace ? old : malloc(sizeof(erow) * (oldn + breaks + 1));
+  int *touched = malloc(sizeof(int) * (oldn + breaks + 1));
+  int ntouched = 0;
+  E.undo.hold = 1;
+
+  char *line = NULL;
+  size_t len = 0, cap = 0;
+  int o = 0, e = 0, j = 0, building = 0;
+  int fr = -1, fc = 0;
+  while (j < oldn) {
+    if (!building) {
+      // Rows up to the next change move along untouched
+      int next = e < n && ed[e].row < oldn ? ed[e].row : oldn;
+      if (!inplace) memcpy(&rows[o], &old[j], sizeof(erow) * (next - j));
+      o += next - j;
+      j = next;
+      if (j == oldn) break;
+      len = 0;
+      building = 1;
+    }
+    erow *r = &old[j];
+    int c = 0, joined = 0;
+    for (; e < n && ed[e].row == j; e++) {
+      struct cursorEdit *d = &ed[e];
+      editorCursorsPut(&line, &len, &cap, &r->chars[c], d->col - c);
+      c = d->col;
+      int at = len;
+      if (fr == -1) {
+        fr = o;
+        fc = at;
+      }
+      if (d->del) {
+        int k = d->del < r->size - c ? d->del : r->size - c;
+        // Taking the row end pulls the next row up
+        int nl = d->del > k;
+        if (k) editorJournalRecord(J_DELETE, o, at, &r->chars[c], k);
+        if (nl) {
+          joined = 1;
+          editorJournalRecord(J_APPEND, o, 0, old[j + 1].chars, old[j + 1].size);
+          editorJournalRecord(J_DEL_ROW, o + 1, 0, NULL, 0);
+          editorRowsDeleted(o + 1, 1);
+        }
+        char *text = malloc(k + nl);
+        memcpy(text, &r->chars[c], k);
+        if (nl) text[k] = '\n';
+        editorUndoAdd(U_DELETE, o, at, text, k + nl);
+        c += k;
+      }
+      if (d->inslen) {
+        const char *s = d->ins, *nl = memchr(s, '\n', d->inslen);
+        if (!nl) {
+          editorJournalRecord(J_INSERT, o, at, s, d->inslen);
+        } else {
+          // Split, the rest of the row as it is now goes down with the last line
+          if (nl > s) editorJournalRecord(J_INSERT, o, at, s, nl - s);
+          editorJournalRecord(J_TRUNCATE, o, at + (nl - s), NULL, 0);
+          char *rest = NULL;
+          size_t rlen = 0, rcap = 0;
+          int at_row = o + 1;
+          for (const char *p = nl + 1; p <= s + d->inslen; p++) {
+            if (p < s + d->inslen && *p != '\n') {
+              editorCursorsPut(&rest, &rlen, &rcap, p, 1);
+              continue;
+            }
+            if (p == s + d->inslen) editorCursorsPut(&rest, &rlen, &rcap, &r->chars[c], r->size - c);
+            editorRowsInserted(at_row, 1);
+            editorJournalRecord(J_INSERT_ROW, at_row++, 0, rest, rlen);
+            rlen = 0;
+          }
+          free(rest);
+        }
+        editorUndoAdd(U_INSERT, o, at, editorUndoText(s, d->inslen), d->inslen);
+        for (int k = 0; k < d->inslen; k++) {
+          if (s[k] != '\n') {
+            editorCursorsPut(&line, &len, &cap, &s[k], 1);
+            continue;
+          }
+          editorCursorsEmit(rows, o, inplace, line, len);
+          touched[ntouched++] = o++;
+          len = 0;
+        }
+      }
+      mc->pos[e].cy = o;
+      mc->pos[e].cx = len;
+    }
+    editorCursorsPut(&line, &len, &cap, &r->chars[c], r->size - c);
+    if (!inplace) {
+      editorUnhashRow(r);
+      editorFreeRow(r);
+    }
+    j++;
+    if (!joined) {
+      editorCursorsEmit(rows, o, inplace, line, len);
+      touched[ntouched++] = o++;
+      building = 0;
+    }
+  }
+  // Cursors past the last line stay there
+  for (; e < n; e++) {
+    mc->pos[e].cy = o;
+    mc->pos[e].cx = 0;
+  }
+  free(line);
+  editorUndoFlush();
+
+  if (!inplace) {
+    free(old);
+    E.row = rows;
+    E.numrows = o;
+    // Untouched rows kept their old idx, move each run of them that shifted in one go
+    for (int k = 0; k < o;) {
+      int delta = k - E.row[k].idx, m = k + 1;
+      while (m < o && m - E.row[m].idx == delta) m++;
+      if (delta) editorShiftRows(k, m, delta);
+      k = m;
+    }
+  }
+  // In order, so multi-line comments carry from one row to the next
+  for (int k = 0; k < ntouched; k++) editorRowChanged(&E.row[touched[k]]);
+  free(touched);
+  if (fr != -1) {
+    E.dirty += n;
+    editorMarkModified(fr, fc);
+  }
+}
+
+// Apply a key that edits to every cursor at once
+void editorCursorsEdit(int key) {
+  struct editorCursors *mc = &E.cursors;
+  int back = key == BACKSPACE || key == CTRL_KEY('h');
+  // Typing past the last line gives it a row first, as editorInsertChar does
+  if (!back && key != DEL_KEY && mc->pos[mc->n - 1].cy == E.numrows) editorInsertRow(E.numrows, "", 0);
+  char ch = key == '\r' ? '\n' : key;
+  struct cursorEdit *ed = malloc(sizeof(struct cursorEdit) * mc->n);
+  for (int i = 0; i < mc->n; i++) {
+    struct cursorPos *p = &mc->pos[i];
+    struct cursorEdit *d = &ed[i];
+    d->row = p->cy;
+    d->col = p->cx;
+    d->del = 0;
+    d->ins = NULL;
+    d->inslen = 0;
+    if (back || key == DEL_KEY) {
+      if (p->cy == E.numrows) continue;
+      if (back && p->cx > 0) {
+        d->col--;
+        d->del = 1;
+      } else if (back && p->cy > 0) {
+        // Join onto the row above, by taking away its end
+        d->row--;
+        d->col = E.row[d->row].size;
+        d->del = 1;
+      } else if (!back && (p->cx < E.row[p->cy].size || p->cy < E.numrows - 1)) {
+        d->del = 1;
+      }
+    } else {
+      d->ins = &ch;
+      d->inslen = 1;
+    }
+  }
+  editorCursorsApply(ed, mc->n);
+  free(ed);
+  E.cy = mc->pos[mc->primary].cy;
+  E.cx = mc->pos[mc->primary].cx;
+  editorCursorsNormalize();
+}
+
+// Put a cursor at the start of every match of a query
+void editorCursorsFind() {
+  char *query = editorPrompt("Cursor at each match: %s (ESC to cancel)", NULL);
+  if (query == NULL) return;
+  size_t qlen = strlen(query);
+  struct editorCursors *mc = &E.cursors;
+  mc->n = 0;
+  for (int row = 0; row < E.numrows && qlen && mc->n < KILO_CURSORS_MAX; row++) {
+    erow *r = &E.row[row];
+    char *p = r->chars, *end = r->chars + r->size, *m;
+    while (mc->n < KILO_CURSORS_MAX && (m = memmem(p, end - p, query, qlen)) != NULL) {
+      editorCursorsAdd(row, m - r->chars);
+      p = m + qlen;
+    }
+  }
+  free(query);
+  if (mc->n == 0) {
+    editorSetStatusMessage("No match");
+    return;
+  }
+  // The primary cursor is the first match from where the cursor was
+  struct cursorPos key = { E.cy, E.cx };
+  int i = 0;
+  while (i < mc->n && editorCursorCmp(&mc->pos[i], &key) < 0) i++;
+  if (i == mc->n) i = 0;
+  E.cy = mc->pos[i].cy;
+  E.cx = mc->pos[i].cx;
+  editorSetStatusMessage("%d cursor%s", mc->n, mc->n == 1 ? "" : "s");
+  editorCursorsNormalize();
+}
+
+// Add a cursor on the row below the last one, in the primary cursor's column
+void editorCursorsAddBelow() {
+  struct editorCursors *mc = &E.cursors;
+  int last = mc->n ? mc->pos[mc->n - 1].cy : E.cy;
+  if (last + 1 >= E.numrows) return;
+  if (mc->n == 0) editorCursorsAdd(E.cy, E.cx);
+  int cx = E.cx < E.row[last + 1].size ? E.cx : E.row[last + 1].size;
+  editorCursorsAdd(last + 1, cx);
+  editorCursorsNormalize();
+}
+
+// Keys that act on every cursor while there are several. Returns 0 for the
+// rest, which drop back to the primary cursor and are handled as usual
+int editorCursorsProcessKey(int c) {
+  struct editorCursors *mc = &E.cursors;
+  mc->pos[mc->primary].cy = E.cy;
+  mc->pos[mc->primary].cx = E.cx;
+  // Rows may have changed under the cursors since the last key
+  editorCursorsNormalize();
+  if (mc->n == 0) return 0;
+  switch (c) {
+    case ARROW_UP:
+    case ARROW_DOWN:
+    case ARROW_LEFT:
+    case ARROW_RIGHT:
+    case HOME_KEY:
+    case END_KEY: {
+      for (int i = 0; i < mc->n; i++) {
+        E.cy = mc->pos[i].cy;
+        E.cx = mc->pos[i].cx;
+        if (c == HOME_KEY) E.cx = 0;
+        else if (c == END_KEY) E.cx = E.cy < E.numrows ? E.row[E.cy].size : 0;
+        else editorMoveCursor(c);
+        mc->pos[i].cy = E.cy;
+        mc->pos[i].cx = E.cx;
+      }
+      E.cy = mc->pos[mc->primary].cy;
+      E.cx = mc->pos[mc->primary].cx;
+      editorCursorsNormalize();
+      return 1;
+    }
+
+    case CTRL_KEY('e'):
+      editorCursorsAddBelow();
+      return 1;
+
+    case '\x1b':
+      mc->n = 0;
+      return 1;
+
+    case '\r':
+    case BACKSPACE:
+    case CTRL_KEY('h'):
+    case DEL_KEY:
+      if (editorCanEdit()) editorCursorsEdit(c);
+      return 1;
+
+    default:
+      if (c == '\t' || (c < ARROW_LEFT && !iscntrl(c))) {
+        if (editorCanEdit()) editorCursorsEdit(c);
+        return 1;
+      }
+      mc->n = 0;
+      return 0;
+  }
+}
+
+/*** kill ring ***/
+
+// Reference to a row's text for the kill ring, shared with the row until it changes
+struct sharedText *editorRowShare(erow *row) {
+  if (row->share == NULL) {
+    row->share = malloc(sizeof(struct sharedText));
+    row->share->refs = 1;
+    row->share->chars = row->chars;
+    row->share->len = row->size;
+  }
+  row->share->refs++;
+  return row->share;
+}
+
+void editorKillFree(struct killEntry *k) {
+  for (int j = 0; j < k->n; j++) {
+    struct sharedText *sh = k->rows[j];
+    if (sh && --sh->refs == 0) {
+      free(sh->chars);
+      free(sh);
+    }
+  }
+  free(k->rows);
+  k->rows = NULL;
+  k->n = 0;
+}
+
+// Ordered ends of the selection, 0 if nothing is selected
+int editorSelectionRange(int *sr, int *sc, int *er, int *ec) {
+  if (!E.sel.active) return 0;
+  int my = E.sel.cy, mx = E.sel.cx;
+  // Edits since the selection started may have taken its start away
+  if (my > E.numrows) my = E.numrows;
+  int rowlen = my < E.numrows ? E.row[my].size : 0;
+  if (mx > rowlen) mx = rowlen;
+  if (my < E.cy || (my == E.cy && mx <= E.cx)) {
+    *sr = my;
+    *sc = mx;
+    *er = E.cy;
+    *ec = E.cx;
+  } else {
+    *sr = E.cy;
+    *sc = E.cx;
+    *er = my;
+    *ec = mx;
+  }
+  return *sr != *er || *sc != *ec;
+}
+
+// Screen columns of row that are selected, from *srx up to *erx
+void editorSelectionRx(int row, int *srx, int *erx) {
+  int sr, sc, er, ec;
+  *srx = *erx = -1;
+  if (!editorSelectionRange(&sr, &sc, &er, &ec) || row < sr || row > er) return;
+  erow *r = &E.row[row];
+  *srx = row == sr ? (E.csv.delim ? editorCsvCxToRx(r, sc) : editorRowCxToRx(r, sc)) : 0;
+  *erx = row == er ? (E.csv.delim ? editorCsvCxToRx(r, ec) : editorRowCxToRx(r, ec)) : INT_MAX;
+}
+
+// Put the text from sr, sc to er, ec in the kill ring, without copying it
+void editorKillAdd(int sr, int sc, int er, int ec) {
+  struct editorKill *kr = &E.kill;
+  struct killEntry *k = &kr->ring[kr->head];
+  editorKillFree(k);
+  k->n = er - sr + 1;
+  k->rows = malloc(sizeof(struct sharedText *) * k->n);
+  k->col = sc;
+  k->endcol = ec;
+  k->len = k->n - 1;
+  for (int j = 0; j < k->n; j++) {
+    k->rows[j] = sr + j < E.numrows ? editorRowShare(&E.row[sr + j]) : NULL;
+    int from = j == 0 ? sc : 0;
+    int to = j == k->n - 1 ? ec : k->rows[j]->len;
+    k->len += to - from;
+  }
+  kr->head = (kr->head + 1) % KILO_KILL_RING;
+  if (kr->n < KILO_KILL_RING) kr->n++;
+}
+
+// Entries back from the newest, 0 for the newest
+struct killEntry *editorKillGet(int back) {
+  struct editorKill *kr = &E.kill;
+  return &kr->ring[(kr->head - 1 - back + 2 * KILO_KILL_RING) % KILO_KILL_RING];
+}
+
+// Text of an entry as one block, for pasting
+char *editorKillText(struct killEntry *k) {
+  char *buf = malloc(k->len ? k->len : 1), *p = buf;
+  for (int j = 0; j < k->n; j++) {
+    int from = j == 0 ? k->col : 0;
+    int to = j == k->n - 1 ? k->endcol : k->rows[j]->len;
+    if (to > from) memcpy(p, &k->rows[j]->chars[from], to - from);
+    p += to - from;
+    if (j < k->n - 1) *p++ = '\n';
+  }
+  return buf;
+}
+
+// Copy the selection to the kill ring, taking it out of the text if cut is set
+void editorCopy(int cut) {
+  int sr, sc, er, ec;
+  if (!editorSelectionRange(&sr, &sc, &er, &ec)) {
+    editorSetStatusMessage("Nothing selected, Ctrl-B starts a selection");
+    return;
+  }
+  if (cut && !editorCanEdit()) return;
+  editorKillAdd(sr, sc, er, ec);
+  size_t len = editorKillGet(0)->len;
+  E.sel.active = 0;
+  if (cut) {
+    editorDeleteText(sr, sc, len);
+    E.cy = sr;
+    E.cx = sc;
+    editorUndoClampCursor();
+  }
+  editorSetStatusMessage("%s %zu bytes", cut ? "Cut" : "Copied", len);
+}
+
+// Put an entry of the kill ring in at the cursor, as one change
+void editorPasteEntry(int back) {
+  struct killEntry *k = editorKillGet(back);
+  char *text = editorKillText(k);
+  int row = E.cy, col = E.cx;
+  struct editorKill *kr = &E.kill;
+  kr->yank = back;
+  kr->yrow = row;
+  kr->ycol = col;
+  // Past the end a line break is added after the text
+  kr->ylen = k->len + (row == E.numrows && k->len && text[k->len - 1] != '\n');
+  editorInsertText(row, col, text, k->len);
+  editorTextEnd(row, col, text, k->len, &E.cy, &E.cx);
+  free(text);
+}
+
+void editorPaste() {
+  if (E.kill.n == 0) {
+    editorSetStatusMessage("Nothing to paste");
+    return;
+  }
+  E.sel.active = 0;
+  editorPasteEntry(0);
+}
 
-  char *buf = malloc(totlen);
-  char *p = buf;
-  // Loop through rows
-  for (j = 0; j < E.numrows; j++) {
+// Swap what the last key pasted for the entry before it in the kill ring
+void editorPasteOlder(int yanked) {
+  if (yanked < 0) {
+    editorSetStatusMessage("Paste with Ctrl-V first");
+    return;
+  }
+  struct editorKill *kr = &E.kill;
+  editorDeleteText(kr->yrow, kr->ycol, kr->ylen);
+  E.cy = kr->yrow;
+  E.cx = kr->ycol;
+  editorPasteEntry((yanked + 1) % kr->n);
+}
+
+/*** line operations ***/
+
+// Threads to split a line operation over n rows across
+int editorLineThreads(int n) {
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  return n < KILO_LINE_MIN || ncpu < 1 ? 1 : ncpu > KILO_LINE_THREADS ? KILO_LINE_THREADS : ncpu;
+}
+
+// Text of rows at..at+n-1, each with its newline
+char *editorRowsText(int at, int n, size_t *len) {
+  size_t total = 0;
+  for (int j = at; j < at + n; j++) total += E.row[j].size + 1;
+  char *buf = malloc(total ? total : 1), *p = buf;
+  for (int j = at; j < at + n; j++) {
     memcpy(p, E.row[j].chars, E.row[j].size);
     p += E.row[j].size;
-    *p = '\n'; // Add newline after each row
-    p++;
+    *p++ = '\n';
   }
-
+  *len = total;
   return buf;
 }
 
-// Open and reading file from disk
-void editorOpen(char *filename) {
-  free(E.filename);
-  E.filename = strdup(filename);
+// Rows the line operations work on: those the selection touches, else the whole file
+void editorLineRange(int *at, int *n) {
+  int sr, sc, er, ec;
+  if (editorSelectionRange(&sr, &sc, &er, &ec)) {
+    // A selection ending at the start of a line doesn't take that line in
+    if (ec == 0 && er > sr) er--;
+    if (er >= E.numrows) er = E.numrows - 1;
+    *at = sr;
+    *n = er - sr + 1;
+  } else {
+    *at = 0;
+    *n = E.numrows;
+  }
+  if (*n < 0) *n = 0;
+}
 
-  editorSelectSyntaxHighlight();
+// Replace rows at..at+n-1 with the newline terminated lines in text, as one change
+void editorReplaceLines(int at, int n, char *text, size_t len) {
+  size_t blen;
+  char *before = editorRowsText(at, n, &blen);
+  E.undo.suspend++;
+  editorDelRowsEdit(at, n);
+  editorInsertRowsEdit(at, text, len);
+  E.undo.suspend--;
+  editorUndoAdd(U_DELETE, at, 0, before, blen);
+  editorUndoAdd(U_INSERT, at, 0, text, len);
+}
 
-  FILE *fp = fopen(filename, "r");
-  if (!fp) die("fopen");
+// Put rows at..at+n-1 in the order given by keep, which lists m of them by offset
+// from at, dropping the rest. The rows themselves are moved, not rebuilt, and
+// highlighted again in one pass. Journal and undo see the old lines replaced by
+// the new ones as one change. Marks follow their lines, those on a dropped line going to
+// the kept line before it. Returns 1 if folds in the rows had to be opened
+int editorReorderRows(int at, int n, int *keep, int m) {
+  // Rows waiting to be rebuilt are found by number, which is about to change
+  editorEditFlush();
+  size_t blen, alen = 0;
+  char *before = editorRowsText(at, n, &blen);
+  for (int k = 0; k < m; k++) alen += E.row[at + keep[k]].size + 1;
+  char *after = malloc(alen ? alen : 1), *p = after;
+  for (int k = 0; k < m; k++) {
+    erow *row = &E.row[at + keep[k]];
+    memcpy(p, row->chars, row->size);
+    p += row->size;
+    *p++ = '\n';
+  }
+  editorJournalRecord(J_DEL_ROWS, at, n, NULL, 0);
+  editorJournalRecord(J_INSERT_ROWS, at, 0, after, alen);
+
+  erow *old = malloc(sizeof(erow) * (n ? n : 1));
+  memcpy(old, &E.row[at], sizeof(erow) * n);
+  char *used = calloc(n ? n : 1, 1);
+  int *to = malloc(sizeof(int) * (n ? n : 1));
+  uint64_t pw = editorHashPow(KILO_HASH_BASE, at);
+  for (int j = 0; j < n; j++) {
+    E.doc_hash -= old[j].hash * pw;
+    pw *= KILO_HASH_BASE;
+  }
+  pw = editorHashPow(KILO_HASH_BASE, at);
+  for (int k = 0; k < m; k++) {
+    E.row[at + k] = old[keep[k]];
+    E.row[at + k].idx = at + k;
+    // Copying a moved row from the original one extent at a time is slower than writing it
+    E.row[at + k].off = -1;
+    E.row[at + k].save_off = -1;
+    E.doc_hash += E.row[at + k].hash * pw;
+    pw *= KILO_HASH_BASE;
+    used[keep[k]] = 1;
+    to[keep[k]] = k;
+  }
+  for (int j = 0; j < n; j++) {
+    if (used[j]) continue;
+    editorFreeRow(&old[j]);
+    to[j] = j ? to[j - 1] : 0;
+  }
+  free(used);
+  free(old);
+  if (m < n) {
+    memmove(&E.row[at + m], &E.row[at + n], sizeof(erow) * (E.numrows - at - n));
+    E.numrows -= n - m;
+    editorShiftRows(at + m, E.numrows, m - n);
+  }
+  int opened = editorFoldReorder(at, n, m);
+  editorMarkReorder(at, n, to, m);
+  free(to);
+  editorStatsDelete(at, n);
+  editorStatsInsert(at, m);
+  // The moved rows come back as new ones, count them again
+  for (int k = 0; k < m; k++) editorStatsUpdate(&E.row[at + k]);
+  for (int k = 0; k < m; k++) editorUpdateSyntax(&E.row[at + k]);
+  if (at + m < E.numrows) editorUpdateSyntax(&E.row[at + m]);
 
-  char *line = NULL;
-  size_t linecap = 0;
-  ssize_t linelen;
-  while ((linelen = getline(&line, &linecap, fp)) != -1) {
-    while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
-      linelen--;
-    editorInsertRow(E.numrows, line, linelen);
+  E.dirty++;
+  editorMarkModified(at, 0);
+  editorUndoAdd(U_DELETE, at, 0, before, blen);
+  editorUndoAdd(U_INSERT, at, 0, after, alen);
+  return opened;
+}
+
+int editorSortCmp(const struct sortKey *a, const struct sortKey *b, const struct sortSpec *sp) {
+  int r = 0;
+  if (sp->numeric) {
+    // NaN is neither above nor below anything, so it goes after every number
+    int an = isnan(a->num), bn = isnan(b->num);
+    if (an != bn) r = an ? 1 : -1;
+    else if (!an && a->num != b->num) r = a->num < b->num ? -1 : 1;
   }
-  free(line);
-  fclose(fp);
-  E.dirty = 0;
+  if (r == 0) {
+    int len = a->len < b->len ? a->len : b->len;
+    r = memcmp(a->s, b->s, len);
+    if (r == 0) r = (a->len > b->len) - (a->len < b->len);
+  }
+  return sp->reverse ? -r : r;
 }
 
-void editorSave() {
-  // Check if new file
-  if (E.filename == NULL) {
-    E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
-    if (E.filename == NULL) {
-      editorSetStatusMessage("Save aborted");
-      return;
+// Fill in the key of a row, its field-th field split on the CSV/TSV delimiter or runs of blanks
+void editorSortKey(struct sortKey *k, erow *row, int at, const struct sortSpec *sp) {
+  const char *s = row->chars, *end = row->chars + row->size;
+  for (int f = 1; f < sp->field && s < end; f++) {
+    if (E.csv.delim) {
+      const char *d = memchr(s, E.csv.delim, end - s);
+      s = d ? d + 1 : end;
+    } else {
+      while (s < end && isspace((unsigned char)*s)) s++;
+      while (s < end && !isspace((unsigned char)*s)) s++;
     }
-    editorSelectSyntaxHighlight();
   }
+  if (sp->field && !E.csv.delim) while (s < end && isspace((unsigned char)*s)) s++;
+  k->s = s;
+  k->len = end - s;
+  if (sp->field && E.csv.delim) {
+    const char *d = memchr(s, E.csv.delim, end - s);
+    if (d) k->len = d - s;
+  }
+  k->num = sp->numeric ? strtod(s, NULL) : 0;
+  k->row = at;
+}
 
-  int len;
-  // Change row to string
-  char *buf = editorRowsToString(&len);
-
-  // Open a new file if doesn't exist
-  int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-  if (fd != -1) {
-    if (ftruncate(fd, len) != -1) {
-      if (write(fd, buf, len) == len) {
-        close(fd);
-        free(buf);
-        E.dirty = 0;
-        editorSetStatusMessage("%d bytes written to disk", len);
-        return;
+void editorMerge(const struct sortKey *a, size_t na, const struct sortKey *b, size_t nb, struct sortKey *out,
+  const struct sortSpec *sp) {
+  size_t i = 0, j = 0, o = 0;
+  while (i < na && j < nb) out[o++] = editorSortCmp(&b[j], &a[i], sp) < 0 ? b[j++] : a[i++];
+  memcpy(&out[o], &a[i], sizeof(struct sortKey) * (na - i));
+  memcpy(&out[o + na - i], &b[j], sizeof(struct sortKey) * (nb - j));
+}
+
+// Stable merge sort of n keys, tmp has room for n
+void editorMergeSort(struct sortKey *a, struct sortKey *tmp, size_t n, const struct sortSpec *sp) {
+  if (n < 16) {
+    for (size_t i = 1; i < n; i++) {
+      struct sortKey k = a[i];
+      size_t j = i;
+      while (j > 0 && editorSortCmp(&k, &a[j - 1], sp) < 0) {
+        a[j] = a[j - 1];
+        j--;
       }
+      a[j] = k;
     }
-    close(fd);
+    return;
   }
+  size_t h = n / 2;
+  editorMergeSort(a, tmp, h, sp);
+  editorMergeSort(&a[h], &tmp[h], n - h, sp);
+  if (editorSortCmp(&a[h], &a[h - 1], sp) >= 0) return;
+  editorMerge(a, h, &a[h], n - h, tmp, sp);
+  memcpy(a, tmp, sizeof(struct sortKey) * n);
+}
 
-  free(buf);
-  editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+void *editorSortThread(void *arg) {
+  struct sortJob *job = arg;
+  if (job->merge) {
+    editorMerge(job->a, job->na, &job->a[job->na], job->n - job->na, job->out, job->sp);
+    return NULL;
+  }
+  for (size_t j = 0; j < job->n; j++) {
+    int at = job->first + j;
+    editorSortKey(&job->a[j], &E.row[job->base + at], at, job->sp);
+  }
+  editorMergeSort(job->a, job->tmp, job->n, job->sp);
+  return NULL;
 }
 
-/*** find ***/
+// Keys of rows at..at+n-1 in sorted order. Each thread keys and sorts a slice, then
+// the slices are merged in pairs, a level at a time, until one run is left
+struct sortKey *editorSortRows(int at, int n, struct sortSpec *sp) {
+  struct sortKey *a = malloc(sizeof(struct sortKey) * (n ? n : 1));
+  struct sortKey *tmp = malloc(sizeof(struct sortKey) * (n ? n : 1));
+  int nt = editorLineThreads(n);
+  struct sortJob jobs[KILO_LINE_THREADS];
+  size_t bound[KILO_LINE_THREADS + 1];
+  for (int t = 0; t <= nt; t++) bound[t] = (size_t)n * t / nt;
+  for (int t = 0; t < nt; t++) {
+    struct sortJob *job = &jobs[t];
+    job->a = &a[bound[t]];
+    job->tmp = &tmp[bound[t]];
+    job->n = bound[t + 1] - bound[t];
+    job->merge = 0;
+    job->base = at;
+    job->first = bound[t];
+    job->sp = sp;
+    if (nt == 1 || pthread_create(&job->thread, NULL, editorSortThread, job) != 0) {
+      editorSortThread(job);
+      job->merge = -1;
+    }
+  }
+  for (int t = 0; t < nt; t++) {
+    if (jobs[t].merge == 0) pthread_join(jobs[t].thread, NULL);
+  }
 
-void editorFindCallback(char *query, int key) {
-  static int last_match = -1;
-  static int direction = 1;
+  // Merge neighbouring runs until one is left
+  int runs = nt;
+  while (runs > 1) {
+    int pairs = runs / 2;
+    for (int t = 0; t < pairs; t++) {
+      struct sortJob *job = &jobs[t];
+      job->a = &a[bound[2 * t]];
+      job->out = &tmp[bound[2 * t]];
+      job->na = bound[2 * t + 1] - bound[2 * t];
+      job->n = bound[2 * t + 2] - bound[2 * t];
+      job->merge = 1;
+      job->sp = sp;
+      if (pthread_create(&job->thread, NULL, editorSortThread, job) != 0) {
+        editorSortThread(job);
+        job->merge = -1;
+      }
+    }
+    // An odd run out is carried over as it is
+    if (runs % 2) memcpy(&tmp[bound[runs - 1]], &a[bound[runs - 1]], sizeof(struct sortKey) * (bound[runs] - bound[runs - 1]));
+    for (int t = 0; t < pairs; t++) {
+      if (jobs[t].merge == 1) pthread_join(jobs[t].thread, NULL);
+    }
+    for (int t = 0; t < pairs; t++) bound[t] = bound[2 * t];
+    if (runs % 2) bound[pairs] = bound[runs - 1];
+    runs = pairs + runs % 2;
+    bound[runs] = n;
+    struct sortKey *swap = a;
+    a = tmp;
+    tmp = swap;
+  }
+  free(tmp);
+  return a;
+}
 
-  static int saved_hl_line; // Saves line to have highlighting restored
-  static char *saved_hl = NULL; // Saves highlighting to restore
+int editorSameRow(int a, int b) {
+  return E.row[a].size == E.row[b].size && E.row[a].hash == E.row[b].hash &&
+    !memcmp(E.row[a].chars, E.row[b].chars, E.row[a].size);
+}
 
-  if (saved_hl) {
-    memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-    free(saved_hl);
-    saved_hl = NULL;
+void editorSortLines(struct sortSpec *sp) {
+  int at, n;
+  editorLineRange(&at, &n);
+  if (n < 2) return;
+  struct sortKey *keys = editorSortRows(at, n, sp);
+  int *keep = malloc(sizeof(int) * n);
+  for (int j = 0; j < n; j++) keep[j] = keys[j].row;
+  free(keys);
+  int opened = editorReorderRows(at, n, keep, n);
+  free(keep);
+  editorSetStatusMessage("Sorted %d lines%s", n, opened ? ", folds in them opened" : "");
+}
+
+// Drop lines that repeat the one before them
+void editorUniqLines() {
+  int at, n;
+  editorLineRange(&at, &n);
+  if (n < 2) return;
+  int *keep = malloc(sizeof(int) * n), m = 0;
+  for (int j = 0; j < n; j++) {
+    if (m == 0 || !editorSameRow(at + keep[m - 1], at + j)) keep[m++] = j;
   }
+  int opened = m < n ? editorReorderRows(at, n, keep, m) : 0;
+  free(keep);
+  editorSetStatusMessage("Removed %d repeated lines%s", n - m, opened ? ", folds in them opened" : "");
+}
 
-  // If pressed enter or escape, exit search mode
-  if (key == '\r' || key == '\x1b') {
-    // Index of row the last match was on, -1 of no last match
-    last_match = -1;
-    // Direction of search, 1 is forward, -1 is backward
-    direction = 1;
+// Distinct line, how often it came up and its place in sorted order
+struct lineCount {
+  int row;
+  int count;
+  int order;
+};
+
+int editorLineCountCmp(const void *a, const void *b) {
+  const struct lineCount *x = a, *y = b;
+  if (x->count != y->count) return x->count < y->count ? 1 : -1;
+  return (x->order > y->order) - (x->order < y->order);
+}
+
+// Replace the lines with each distinct one once, with how often it came up, most common first
+void editorCountLines() {
+  int at, n;
+  editorLineRange(&at, &n);
+  if (n < 1) return;
+  struct sortSpec sp = { 0, 0, 0 };
+  struct sortKey *keys = editorSortRows(at, n, &sp);
+  struct lineCount *counts = malloc(sizeof(struct lineCount) * n);
+  int m = 0;
+  size_t len = 0;
+  for (int j = 0; j < n; j++) {
+    if (m > 0 && editorSameRow(at + counts[m - 1].row, at + keys[j].row)) {
+      counts[m - 1].count++;
+      continue;
+    }
+    counts[m].row = keys[j].row;
+    counts[m].count = 1;
+    counts[m].order = m;
+    len += E.row[at + keys[j].row].size + 16;
+    m++;
+  }
+  free(keys);
+  qsort(counts, m, sizeof(struct lineCount), editorLineCountCmp);
+
+  char *text = malloc(len), *p = text;
+  for (int j = 0; j < m; j++) {
+    erow *row = &E.row[at + counts[j].row];
+    p += sprintf(p, "%7d ", counts[j].count);
+    memcpy(p, row->chars, row->size);
+    p += row->size;
+    *p++ = '\n';
+  }
+  free(counts);
+  editorReplaceLines(at, n, text, p - text);
+  editorSetStatusMessage("%d distinct lines", m);
+}
+
+// New text of a line for a bulk transform, NULL if it stays as it is
+char *editorTransformLine(int op, const char *s, int len, int *outlen) {
+  char *out;
+  int lead = 0, width = 0;
+  switch (op) {
+    case T_INDENT:
+      if (len == 0) return NULL;
+      out = malloc((size_t)len + 2);
+      out[0] = '\t';
+      memcpy(&out[1], s, len + 1);
+      *outlen = len + 1;
+      return out;
+
+    case T_OUTDENT:
+      // One tab, or up to a tab stop's worth of spaces
+      if (len > 0 && s[0] == '\t') lead = 1;
+      else while (lead < len && lead < KILO_TAB_STOP && s[lead] == ' ') lead++;
+      if (lead == 0) return NULL;
+      *outlen = len - lead;
+      out = malloc((size_t)*outlen + 1);
+      memcpy(out, &s[lead], *outlen + 1);
+      return out;
+
+    case T_EXPAND:
+      if (memchr(s, '\t', len) == NULL) return NULL;
+      return editorRender(s, len, outlen);
+
+    case T_UNEXPAND: {
+      // Leading blanks become as many tabs as fit, then spaces
+      while (lead < len && (s[lead] == ' ' || s[lead] == '\t')) {
+        width = s[lead] == '\t' ? (width / KILO_TAB_STOP + 1) * KILO_TAB_STOP : width + 1;
+        lead++;
+      }
+      int tabs = width / KILO_TAB_STOP, spaces = width % KILO_TAB_STOP;
+      int same = lead == tabs + spaces;
+      for (int j = 0; same && j < lead; j++) same = s[j] == (j < tabs ? '\t' : ' ');
+      if (same) return NULL;
+      *outlen = tabs + spaces + len - lead;
+      out = malloc((size_t)*outlen + 1);
+      memset(out, '\t', tabs);
+      memset(&out[tabs], ' ', spaces);
+      memcpy(&out[tabs + spaces], &s[lead], len - lead + 1);
+      return out;
+    }
+
+    case T_TRIM: {
+      int end = len;
+      while (end > 0 && (s[end - 1] == ' ' || s[end - 1] == '\t' || s[end - 1] == '\r')) end--;
+      if (end == len) return NULL;
+      out = malloc((size_t)end + 1);
+      memcpy(out, s, end);
+      out[end] = '\0';
+      *outlen = end;
+      return out;
+    }
+
+    case T_UPPER:
+    case T_LOWER: {
+      // Only ASCII letters, so UTF-8 sequences are left whole
+      int j = 0;
+      while (j < len && !(op == T_UPPER ? (s[j] >= 'a' && s[j] <= 'z') : (s[j] >= 'A' && s[j] <= 'Z'))) j++;
+      if (j >= len) return NULL;
+      out = malloc((size_t)len + 1);
+      memcpy(out, s, len + 1);
+      for (; j < len; j++) {
+        if (op == T_UPPER && out[j] >= 'a' && out[j] <= 'z') out[j] -= 'a' - 'A';
+        else if (op == T_LOWER && out[j] >= 'A' && out[j] <= 'Z') out[j] += 'a' - 'A';
+      }
+      *outlen = len;
+      return out;
+    }
+  }
+  return NULL;
+}
+
+void *editorTransformThread(void *arg) {
+  struct transformJob *job = arg;
+  for (int j = job->from; j < job->to; j++) {
+    erow *row = &E.row[job->base + j];
+    job->out[j] = editorTransformLine(job->op, row->chars, row->size, &job->outlen[j]);
+    if (job->out[j] == NULL) continue;
+    job->render[j] = editorRender(job->out[j], job->outlen[j], &job->rsize[j]);
+    job->hash[j] = editorHash(job->out[j], job->outlen[j]);
+  }
+  return NULL;
+}
+
+// Apply a transform to every line of the range. Worker threads each build the new
+// text, rendering and hash of a slice of the rows, then the changed rows are swapped
+// in together and highlighted in one pass. The span from the first changed row to
+// the last is one change for journal and undo
+void editorTransformLines(int op) {
+  int at, n;
+  editorLineRange(&at, &n);
+  if (n < 1) return;
+  char **out = malloc(sizeof(char *) * n);
+  int *outlen = malloc(sizeof(int) * n);
+  char **render = malloc(sizeof(char *) * n);
+  int *rsize = malloc(sizeof(int) * n);
+  uint64_t *hash = malloc(sizeof(uint64_t) * n);
+
+  int nt = editorLineThreads(n);
+  struct transformJob jobs[KILO_LINE_THREADS];
+  for (int t = 0; t < nt; t++) {
+    struct transformJob *job = &jobs[t];
+    job->op = op;
+    job->base = at;
+    job->from = (long long)n * t / nt;
+    job->to = (long long)n * (t + 1) / nt;
+    job->out = out;
+    job->outlen = outlen;
+    job->render = render;
+    job->rsize = rsize;
+    job->hash = hash;
+    job->threaded = nt > 1 && pthread_create(&job->thread, NULL, editorTransformThread, job) == 0;
+    if (!job->threaded) editorTransformThread(job);
+  }
+  for (int t = 0; t < nt; t++) {
+    if (jobs[t].threaded) pthread_join(jobs[t].thread, NULL);
+  }
+
+  int first = 0, last = n - 1, changed = 0;
+  while (first < n && out[first] == NULL) first++;
+  while (last > first && out[last] == NULL) last--;
+  if (first < n) {
+    int span = last - first + 1;
+    size_t blen, alen = 0;
+    char *before = editorRowsText(at + first, span, &blen);
+    for (int j = first; j <= last; j++) alen += (out[j] ? outlen[j] : E.row[at + j].size) + 1;
+    char *after = malloc(alen), *p = after;
+    for (int j = first; j <= last; j++) {
+      int len = out[j] ? outlen[j] : E.row[at + j].size;
+      memcpy(p, out[j] ? out[j] : E.row[at + j].chars, len);
+      p += len;
+      *p++ = '\n';
+    }
+    editorJournalRecord(J_DEL_ROWS, at + first, span, NULL, 0);
+    editorJournalRecord(J_INSERT_ROWS, at + first, 0, after, alen);
+
+    for (int j = first; j <= last; j++) {
+      if (out[j] == NULL) continue;
+      erow *row = &E.row[at + j];
+      editorRowRelease(row);
+      row->chars = out[j];
+      row->size = outlen[j];
+      editorSetRender(row, render[j], rsize[j], hash[j]);
+      row->off = -1;
+      row->save_off = -1;
+      changed++;
+    }
+    for (int j = first; j <= last; j++) {
+      if (out[j]) editorUpdateSyntax(&E.row[at + j]);
+    }
+    E.dirty++;
+    editorMarkModified(at + first, 0);
+    editorUndoAdd(U_DELETE, at + first, 0, before, blen);
+    editorUndoAdd(U_INSERT, at + first, 0, after, alen);
+  }
+  free(out);
+  free(outlen);
+  free(render);
+  free(rsize);
+  free(hash);
+  editorSetStatusMessage("%d lines changed", changed);
+}
+
+// Line operations typed at a prompt
+void editorCommand() {
+  char *cmd = editorPrompt("Command: %s (sort, uniq, count, indent, outdent, retab, trim, upper, lower, fold, unfold, mark, jump)", NULL);
+  if (cmd == NULL) return;
+  char *save, *word = strtok_r(cmd, " ", &save);
+  if (word == NULL) {
+    free(cmd);
     return;
-  } else if (key == ARROW_RIGHT || key == ARROW_DOWN) { // Always search in forward
-    direction = 1;
-  } else if (key == ARROW_LEFT || key == ARROW_UP) { // Unless user asked to search backwards
-    direction = -1;
-  } else { // Only advance if arrow key is pressed
-    last_match = -1;
-    direction = 1;
   }
+  // Folds and marks only change what is shown, so they work on read-only buffers too
+  if (!strcmp(word, "fold")) {
+    editorFoldAll();
+    free(cmd);
+    return;
+  }
+  if (!strcmp(word, "unfold")) {
+    editorFoldClear();
+    editorSetStatusMessage("All folds opened");
+    free(cmd);
+    return;
+  }
+  if (!strcmp(word, "mark") || !strcmp(word, "jump")) {
+    char *name = strtok_r(NULL, " ", &save);
+    if (name == NULL || name[1] != '\0' || name[0] < 'a' || name[0] > 'z') editorSetStatusMessage("Marks are named a to z");
+    else if (word[0] == 'm') editorMarkSet(name[0]);
+    else editorMarkJump(name[0]);
+    free(cmd);
+    return;
+  }
+  if (!editorCanEdit()) {
+    free(cmd);
+    return;
+  }
+  if (!strcmp(word, "sort")) {
+    struct sortSpec sp = { 0, 0, 0 };
+    char *opt;
+    while ((opt = strtok_r(NULL, " ", &save)) != NULL) {
+      if (!strcmp(opt, "-n")) sp.numeric = 1;
+      else if (!strcmp(opt, "-r")) sp.reverse = 1;
+      else if (!strcmp(opt, "-k") && (opt = strtok_r(NULL, " ", &save)) != NULL) sp.field = atoi(opt);
+    }
+    if (sp.field < 0) sp.field = 0;
+    editorSortLines(&sp);
+  } else if (!strcmp(word, "uniq")) {
+    editorUniqLines();
+  } else if (!strcmp(word, "count")) {
+    editorCountLines();
+  } else if (!strcmp(word, "indent")) {
+    editorTransformLines(T_INDENT);
+  } else if (!strcmp(word, "outdent")) {
+    editorTransformLines(T_OUTDENT);
+  } else if (!strcmp(word, "retab")) {
+    char *opt = strtok_r(NULL, " ", &save);
+    editorTransformLines(opt && !strcmp(opt, "-t") ? T_UNEXPAND : T_EXPAND);
+  } else if (!strcmp(word, "trim")) {
+    editorTransformLines(T_TRIM);
+  } else if (!strcmp(word, "upper")) {
+    editorTransformLines(T_UPPER);
+  } else if (!strcmp(word, "lower")) {
+    editorTransformLines(T_LOWER);
+  } else {
+    editorSetStatusMessage("Unknown command: %s", word);
+  }
+  E.sel.active = 0;
+  editorUndoClampCursor();
+  free(cmd);
+}
 
-  if (last_match == -1) direction = 1;
-  int current = last_match;
-  int i;
-  // Loop through all the rows of file
-  for (i = 0; i < E.numrows; i++) {
-    current += direction;
-    if (current == -1) current = E.numrows - 1;
-    else if (current == E.numrows) current = 0;
+/*** append buffer ***/
 
-    erow *row = &E.row[current];
-    // Check if row contains query string
-    char *match = strstr(row->render, query);
-    // Move cursor to the match
-    if (match) {
-      // Start next match from current point
-      last_match = current;
-      E.cy = current;
-      E.cx = editorRowRxToCx(row, match - row->render);
-      E.cx = match - row->render;
-      E.rowoff = E.numrows;
+struct abuf {
+  char *b;
+  int len;
+};
+
+#define ABUF_INIT {NULL, 0}
+
+// Append to buffer to prevent small flickers between writes
+void abAppend(struct abuf *ab, const char *s, int len) {
+  // Allocate memory to hold new string
+  char *new = realloc(ab->b, ab->len + len);
+
+  if (new == NULL) return;
+  // Copy string s after end of current data in buffer
+  memcpy(&new[ab->len], s, len);
+  ab->b = new;
+  ab->len += len;
+}
+
+// Deallocates dynamic memory used by struct abuf
+void abFree(struct abuf *ab) {
+  free(ab->b);
+}
+
+/*** hex view ***/
+
+// Look for NUL bytes or lots of control characters, testing eight bytes at a time
+int editorIsBinary(const unsigned char *buf, size_t len) {
+  size_t ctrl = 0, i = 0;
+  uint64_t w;
+  for (; i + 8 <= len; i += 8) {
+    memcpy(&w, &buf[i], 8);
+    // Nonzero if any byte is below 0x20, true for nearly all words of text
+    if (!((w - SWAR_ONES * 0x20) & ~w & SWAR_HIGHS)) continue;
+    // Any zero byte means binary
+    if ((w - SWAR_ONES) & ~w & SWAR_HIGHS) return 1;
+    for (int k = 0; k < 8; k++) {
+      unsigned char c = buf[i + k];
+      if (c < 0x20 && c != '\t' && c != '\n' && c != '\r' && c != '\f' && c != '\x1b') ctrl++;
+    }
+  }
+  for (; i < len; i++) {
+    if (buf[i] == 0) return 1;
+    if (buf[i] < 0x20 && !strchr("\t\n\r\f\x1b", buf[i])) ctrl++;
+  }
+  return len && ctrl * 100 / len >= KILO_BINARY_PCT;
+}
+
+// Map the whole file, the page cache does the rest so memory stays constant
+void editorHexOpen(int fd) {
+  struct editorHex *h = &E.hex;
+  h->size = E.disk.st_size;
+  h->map = h->size ? mmap(NULL, h->size, PROT_READ, MAP_SHARED, fd, 0) : NULL;
+  if (h->size && h->map == MAP_FAILED) die("mmap");
+  h->top = 0;
+  h->cur = 0;
+  h->pat = NULL;
+  h->patlen = 0;
+  h->active = 1;
+  E.readonly = 1;
+}
+
+void editorHexScroll() {
+  struct editorHex *h = &E.hex;
+  size_t page = (size_t)E.screenrows * KILO_HEX_WIDTH;
+  if (h->cur < h->top) h->top = h->cur - h->cur % KILO_HEX_WIDTH;
+  if (h->cur >= h->top + page) h->top = h->cur - h->cur % KILO_HEX_WIDTH - page + KILO_HEX_WIDTH;
+}
+
+// Offset, hex bytes and printable characters for each line on screen
+void editorHexDrawRows(struct abuf *ab) {
+  struct editorHex *h = &E.hex;
+  char buf[32];
+  for (int y = 0; y < E.screenrows; y++) {
+    size_t line = h->top + (size_t)y * KILO_HEX_WIDTH;
+    if (line >= h->size) {
+      abAppend(ab, "~", 1);
+    } else {
+      int len = snprintf(buf, sizeof(buf), "%08zx  ", line);
+      abAppend(ab, buf, len);
+      size_t n = h->size - line < KILO_HEX_WIDTH ? h->size - line : KILO_HEX_WIDTH;
+      for (int k = 0; k < KILO_HEX_WIDTH; k++) {
+        if ((size_t)k < n) {
+          len = snprintf(buf, sizeof(buf), "%02x", h->map[line + k]);
+          // Show the cursor byte inverted
+          if (line + k == h->cur) abAppend(ab, "\x1b[7m", 4);
+          abAppend(ab, buf, len);
+          if (line + k == h->cur) abAppend(ab, "\x1b[m", 3);
+        } else {
+          abAppend(ab, "  ", 2);
+        }
+        abAppend(ab, k == KILO_HEX_WIDTH / 2 - 1 ? "  " : " ", k == KILO_HEX_WIDTH / 2 - 1 ? 2 : 1);
+      }
+      abAppend(ab, "|", 1);
+      for (size_t k = 0; k < n; k++) {
+        unsigned char c = h->map[line + k];
+        char sym = (c >= 0x20 && c < 0x7f) ? c : '.';
+        if (line + k == h->cur) abAppend(ab, "\x1b[7m", 4);
+        abAppend(ab, &sym, 1);
+        if (line + k == h->cur) abAppend(ab, "\x1b[m", 3);
+      }
+      abAppend(ab, "|", 1);
+    }
+    abAppend(ab, "\x1b[K", 3);
+    abAppend(ab, "\r\n", 2);
+  }
+}
+
+// Screen column of the cursor byte in the hex columns
+int editorHexCursorCol() {
+  int k = E.hex.cur % KILO_HEX_WIDTH;
+  // The offset label widens past 8 digits from 4 GiB on
+  int label = snprintf(NULL, 0, "%08zx  ", E.hex.cur - k);
+  return label + k * 3 + (k >= KILO_HEX_WIDTH / 2 ? 1 : 0);
+}
+
+// Parse "de ad be ef" into bytes, or take the text between quotes literally
+unsigned char *editorHexParsePattern(const char *query, size_t *len) {
+  size_t qlen = strlen(query);
+  unsigned char *pat = malloc(qlen + 1);
+  *len = 0;
+  if (query[0] == '"') {
+    const char *end = strrchr(query + 1, '"');
+    size_t n = end ? (size_t)(end - query - 1) : qlen - 1;
+    memcpy(pat, query + 1, n);
+    *len = n;
+    return pat;
+  }
+  const char *p = query;
+  while (*p) {
+    if (isspace((unsigned char)*p)) {
+      p++;
+      continue;
+    }
+    if (!isxdigit((unsigned char)p[0]) || !isxdigit((unsigned char)p[1])) {
+      free(pat);
+      return NULL;
+    }
+    char byte[3] = { p[0], p[1], '\0' };
+    pat[(*len)++] = strtoul(byte, NULL, 16);
+    p += 2;
+  }
+  return pat;
+}
+
+// Find the next occurrence of the pattern after the cursor, wrapping at the end
+void editorHexFindNext() {
+  struct editorHex *h = &E.hex;
+  if (!h->pat || !h->patlen) return;
+  size_t from = h->cur + 1 < h->size ? h->cur + 1 : 0;
+  unsigned char *m = memmem(h->map + from, h->size - from, h->pat, h->patlen);
+  if (!m) m = memmem(h->map, from + h->patlen - 1 < h->size ? from + h->patlen - 1 : h->size, h->pat, h->patlen);
+  if (!m) {
+    editorSetStatusMessage("Pattern not found");
+    return;
+  }
+  h->cur = m - h->map;
+  editorSetStatusMessage("Found at 0x%zx", h->cur);
+}
+
+void editorHexFind() {
+  char *query = editorPrompt("Search bytes: %s (hex like 7f 45, or \"text\")", NULL);
+  if (!query) return;
+  size_t len;
+  unsigned char *pat = editorHexParsePattern(query, &len);
+  free(query);
+  if (!pat || !len) {
+    free(pat);
+    editorSetStatusMessage("Bad pattern, use hex bytes or \"text\"");
+    return;
+  }
+  free(E.hex.pat);
+  E.hex.pat = pat;
+  E.hex.patlen = len;
+  // Include the byte under the cursor in the first search
+  if (E.hex.cur > 0) E.hex.cur--;
+  else E.hex.cur = E.hex.size;
+  editorHexFindNext();
+}
+
+// Jump to an offset, given in hex with 0x or in decimal, or relative with + and -
+void editorHexGoto() {
+  char *query = editorPrompt("Go to offset: %s (ESC to cancel)", NULL);
+  if (!query) return;
+  char *p = query, *end;
+  int sign = 0;
+  if (*p == '+' || *p == '-') sign = *p++ == '+' ? 1 : -1;
+  unsigned long long off = strtoull(p, &end, 0);
+  if (end == p || *end) {
+    editorSetStatusMessage("Bad offset: %s", query);
+  } else {
+    struct editorHex *h = &E.hex;
+    if (sign > 0) off = h->cur + off;
+    else if (sign < 0) off = off > h->cur ? 0 : h->cur - off;
+    h->cur = h->size == 0 ? 0 : off < h->size ? off : h->size - 1;
+  }
+  free(query);
+}
+
+// Handle a key in the hex view, returns 0 if the key should get its normal meaning
+int editorHexProcessKey(int c) {
+  struct editorHex *h = &E.hex;
+  size_t page = (size_t)E.screenrows * KILO_HEX_WIDTH;
+  size_t last = h->size ? h->size - 1 : 0;
+  switch (c) {
+    case ARROW_LEFT: if (h->cur > 0) h->cur--; break;
+    case ARROW_RIGHT: if (h->cur < last) h->cur++; break;
+    case ARROW_UP: if (h->cur >= KILO_HEX_WIDTH) h->cur -= KILO_HEX_WIDTH; break;
+    case ARROW_DOWN: if (h->cur + KILO_HEX_WIDTH <= last) h->cur += KILO_HEX_WIDTH; break;
+    case PAGE_UP:
+      h->cur = h->cur > page ? h->cur - page : 0;
+      h->top = h->top > page ? h->top - page : 0;
+      break;
+    case PAGE_DOWN:
+      h->cur = h->cur + page < last ? h->cur + page : last;
+      if (h->top + page < h->size) h->top += page;
+      break;
+    case HOME_KEY: h->cur -= h->cur % KILO_HEX_WIDTH; break;
+    case END_KEY:
+      h->cur += KILO_HEX_WIDTH - 1 - h->cur % KILO_HEX_WIDTH;
+      if (h->cur > last) h->cur = last;
+      break;
+    case CTRL_KEY('g'): editorHexGoto(); break;
+    case CTRL_KEY('f'): editorHexFind(); break;
+    case CTRL_KEY('n'): editorHexFindNext(); break;
+    // There are no rows behind the view, so nothing to save or reload into
+    case CTRL_KEY('s'):
+    case CTRL_KEY('r'):
+      editorSetStatusMessage("Binary files are read-only in hex view");
+      break;
+    default: return 0;
+  }
+  return 1;
+}
+
+/*** tabular files ***/
+
+// Find where each field of a CSV/TSV row starts, ignoring delimiters inside quotes.
+// Eight bytes are tested at a time so long runs without a delimiter or quote are skipped
+void editorCsvIndex(erow *row) {
+  char d = E.csv.delim;
+  uint64_t dm = SWAR_ONES * (unsigned char)d, qm = SWAR_ONES * '"';
+  int cap = 16, n = 0, quoted = 0;
+  int *f = malloc(sizeof(int) * cap);
+  f[n++] = 0;
+  int j = 0;
+  while (j < row->size) {
+    int end = row->size;
+    if (j + 8 <= row->size) {
+      uint64_t w, a, b;
+      memcpy(&w, &row->chars[j], 8);
+      a = w ^ dm;
+      b = w ^ qm;
+      if (!((((a - SWAR_ONES) & ~a) | ((b - SWAR_ONES) & ~b)) & SWAR_HIGHS)) {
+        j += 8;
+        continue;
+      }
+      end = j + 8;
+    }
+    for (; j < end; j++) {
+      char c = row->chars[j];
+      // A doubled quote inside a quoted field flips twice and changes nothing
+      if (c == '"') {
+        quoted = !quoted;
+      } else if (c == d && !quoted) {
+        if (n + 1 >= cap) {
+          cap *= 2;
+          f = realloc(f, sizeof(int) * cap);
+        }
+        f[n++] = j + 1;
+      }
+    }
+  }
+  f[n] = row->size + 1;
+  row->fields = f;
+  row->nfields = n;
+}
+
+int *editorCsvFields(erow *row) {
+  if (row->nfields < 0) editorCsvIndex(row);
+  return row->fields;
+}
+
+// Field of a row that contains character cx
+int editorCsvFieldAt(erow *row, int cx) {
+  int *f = editorCsvFields(row);
+  int lo = 0, hi = row->nfields - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (f[mid] <= cx) lo = mid;
+    else hi = mid - 1;
+  }
+  return lo;
+}
+
+// Make column col at least w wide, adding columns as needed
+void editorCsvWiden(int col, int w) {
+  struct editorCsv *t = &E.csv;
+  if (col >= t->ncols) {
+    t->width = realloc(t->width, sizeof(int) * (col + 1));
+    t->start = realloc(t->start, sizeof(int) * (col + 2));
+    while (t->ncols <= col) t->width[t->ncols++] = 1;
+  }
+  if (w > KILO_CSV_MAXWIDTH) w = KILO_CSV_MAXWIDTH;
+  if (w > t->width[col]) t->width[col] = w;
+}
+
+void editorCsvMeasure(erow *row) {
+  int *f = editorCsvFields(row);
+  for (int k = 0; k < row->nfields; k++) editorCsvWiden(k, f[k + 1] - 1 - f[k]);
+}
+
+// Pick widths from the first rows and rows spread evenly over the rest of the file,
+// so a large file isn't read end to end just to lay out the screen
+void editorCsvSample() {
+  struct editorCsv *t = &E.csv;
+  t->ncols = 0;
+  int head = E.numrows < KILO_CSV_SAMPLE / 2 ? E.numrows : KILO_CSV_SAMPLE / 2;
+  for (int j = 0; j < head; j++) editorCsvMeasure(&E.row[j]);
+  int rest = E.numrows - head;
+  if (rest > 0) {
+    int step = rest / (KILO_CSV_SAMPLE / 2);
+    if (step < 1) step = 1;
+    for (int j = head; j < E.numrows; j += step) editorCsvMeasure(&E.row[j]);
+  }
+  t->stale = 0;
+}
 
-      saved_hl_line = current;
-      saved_hl = malloc(row->rsize);
+// Rows at the top of the screen that stay put, 1 when the header row is frozen
+int editorCsvHeaderLines() {
+  return (E.csv.delim && E.csv.header && E.numrows > 0) ? 1 : 0;
+}
 
-      memcpy(saved_hl, row->hl, row->rsize);
-      memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-      break;
+// Widen columns for what is on screen now and place them
+void editorCsvLayout() {
+  struct editorCsv *t = &E.csv;
+  if (t->stale) editorCsvSample();
+  int top = editorCsvHeaderLines();
+  for (int y = 0; y < E.screenrows; y++) {
+    int filerow = y < top ? y : editorFoldVisibleToRow(y + E.rowoff);
+    if (filerow >= E.numrows) break;
+    editorCsvMeasure(&E.row[filerow]);
+  }
+  if (E.cy < E.numrows) editorCsvMeasure(&E.row[E.cy]);
+  if (t->ncols == 0) return;
+  t->start[0] = 0;
+  // One column between fields for the separator
+  for (int k = 0; k < t->ncols; k++) t->start[k + 1] = t->start[k] + t->width[k] + 1;
+}
+
+// Screen column of character cx once fields are lined up
+int editorCsvCxToRx(erow *row, int cx) {
+  int k = editorCsvFieldAt(row, cx);
+  int *f = row->fields;
+  int len = f[k + 1] - 1 - f[k], w = E.csv.width[k], o = cx - f[k];
+  // Past the end of the field is the separator, characters cut off share the last column
+  if (o >= len) return E.csv.start[k] + (len < w ? len : w);
+  return E.csv.start[k] + (o < w - 1 ? o : w - 1);
+}
+
+// Lay a row out in aligned columns, returns its length and points c and hl at it
+int editorCsvRender(erow *row, char **c, unsigned char **hl) {
+  struct editorCsv *t = &E.csv;
+  int *f = editorCsvFields(row);
+  int len = row->nfields ? t->start[row->nfields] - 1 : 0;
+  if (len + 1 > t->linecap) {
+    t->linecap = len + 1;
+    t->line = realloc(t->line, t->linecap);
+    t->hl = realloc(t->hl, t->linecap);
+  }
+  memset(t->line, ' ', len);
+  memset(t->hl, HL_NORMAL, len);
+  int ri = 0; // Position in render, to look up highlighting
+  for (int k = 0; k < row->nfields; k++) {
+    int flen = f[k + 1] - 1 - f[k], w = t->width[k];
+    char *out = &t->line[t->start[k]];
+    unsigned char *outhl = &t->hl[t->start[k]];
+    for (int i = 0; i <= flen && f[k] + i < row->size; i++) {
+      char ch = row->chars[f[k] + i];
+      if (i < flen && i < w) {
+        out[i] = ch == '\t' ? ' ' : ch;
+        outhl[i] = row->hl[ri];
+      }
+      ri += ch == '\t' ? KILO_TAB_STOP - ri % KILO_TAB_STOP : 1;
     }
+    if (flen > w) out[w - 1] = '>';
+    if (k + 1 < row->nfields) out[w] = '|';
   }
+  *c = t->line;
+  *hl = t->hl;
+  return len;
 }
 
-void editorFind() {
-  int saved_cx = E.cx;
-  int saved_cy = E.cy;
-  int saved_coloff = E.coloff;
-  int saved_rowoff = E.rowoff;
+// Ctrl-Left and Ctrl-Right jump between fields, other files just move a character
+void editorCsvMoveField(int key) {
+  if (!E.csv.delim || E.cy >= E.numrows) {
+    editorMoveCursor(key == CTRL_ARROW_LEFT ? ARROW_LEFT : ARROW_RIGHT);
+    return;
+  }
+  erow *row = &E.row[E.cy];
+  int k = editorCsvFieldAt(row, E.cx);
+  int *f = row->fields;
+  if (key == CTRL_ARROW_RIGHT) {
+    if (k + 1 < row->nfields) {
+      E.cx = f[k + 1];
+    } else if (E.cy + 1 < E.numrows) {
+      E.cy++;
+      E.cx = 0;
+    }
+  } else {
+    if (E.cx > f[k]) {
+      E.cx = f[k];
+    } else if (k > 0) {
+      E.cx = f[k - 1];
+    } else if (E.cy > 0) {
+      E.cy--;
+      row = &E.row[E.cy];
+      f = editorCsvFields(row);
+      E.cx = f[row->nfields - 1];
+    }
+  }
+}
 
-  char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
+/*** diff view ***/
+
+// Build the line array of one side, hashing each line as it goes
+void editorDiffLoad(struct diffSide *side, const char *path) {
+  side->name = path;
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) die(path);
+  struct stat st;
+  if (fstat(fd, &st) == -1) die("fstat");
+  side->size = st.st_size;
+  side->map = side->size ? mmap(NULL, side->size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+  if (side->size && side->map == MAP_FAILED) die("mmap");
+  close(fd);
+
+  int cap = 1024;
+  side->lines = malloc(sizeof(struct diffLine) * cap);
+  side->n = 0;
+  char *p = side->map, *end = side->map + side->size;
+  while (p < end) {
+    char *nl = memchr(p, '\n', end - p);
+    size_t len = (nl ? nl : end) - p;
+    if (side->n == cap) {
+      cap *= 2;
+      side->lines = realloc(side->lines, sizeof(struct diffLine) * cap);
+    }
+    struct diffLine *l = &side->lines[side->n++];
+    l->s = p;
+    l->len = (len > 0 && p[len - 1] == '\r') ? len - 1 : len;
+    l->hash = editorHash(l->s, l->len);
+    p = nl ? nl + 1 : end;
+  }
+}
 
-  if (query) {
-    free(query);
+// Give every distinct line a small id, equal lines on either side share one
+int editorDiffNumber(struct diffSide *a, struct diffSide *b) {
+  size_t cap = 1;
+  while (cap < 2 * (size_t)(a->n + b->n) + 1) cap <<= 1;
+  struct diffLine **slot = calloc(cap, sizeof(struct diffLine *));
+  int ids = 0;
+  struct diffSide *sides[2] = { a, b };
+  for (int s = 0; s < 2; s++) {
+    for (int j = 0; j < sides[s]->n; j++) {
+      struct diffLine *l = &sides[s]->lines[j];
+      size_t h = l->hash & (cap - 1);
+      while (slot[h] && (slot[h]->hash != l->hash || slot[h]->len != l->len ||
+          memcmp(slot[h]->s, l->s, l->len))) {
+        h = (h + 1) & (cap - 1);
+      }
+      if (!slot[h]) {
+        slot[h] = l;
+        l->id = ids++;
+      } else {
+        l->id = slot[h]->id;
+      }
+    }
+  }
+  free(slot);
+  return ids;
+}
+
+// Find a point on an optimal path through a[alo..ahi) and b[blo..bhi) by running the
+// forward and backward searches until they overlap. Fd and bd are indexed by diagonal
+void editorDiffSplit(struct diffSeq *q, int alo, int ahi, int blo, int bhi, int *xmid, int *ymid) {
+  int *A = q->a, *B = q->b, *Fd = q->fd, *Bd = q->bd;
+  int N = ahi - alo, M = bhi - blo, delta = N - M, odd = delta & 1;
+  int max = (N + M + 1) / 2;
+  Fd[1] = 0;
+  Bd[1] = 0;
+  for (int d = 0; d <= max; d++) {
+    // Forward d-paths
+    for (int k = -d; k <= d; k += 2) {
+      int x;
+      // Down from diagonal k+1 or right from k-1, whichever gets further and stays inside
+      int xd = (k == d && d > 0) ? -1 : Fd[k + 1];
+      int xr = (k == -d) ? -1 : Fd[k - 1];
+      if (xd >= 0 && xd - k > M) xd = -1;
+      if (xr >= 0 && ++xr > N) xr = -1;
+      x = xd > xr ? xd : xr;
+      if (x < 0) {
+        Fd[k] = -1;
+        continue;
+      }
+      int y = x - k;
+      while (x < N && y < M && A[alo + x] == B[blo + y]) x++, y++;
+      Fd[k] = x;
+      int kb = delta - k;
+      if (odd && kb >= -(d - 1) && kb <= d - 1 && Bd[kb] >= 0 && x + Bd[kb] >= N) {
+        *xmid = alo + x;
+        *ymid = blo + y;
+        return;
+      }
+    }
+    // Backward d-paths, x and y count lines from the ends
+    for (int k = -d; k <= d; k += 2) {
+      int xd = (k == d && d > 0) ? -1 : Bd[k + 1];
+      int xr = (k == -d) ? -1 : Bd[k - 1];
+      if (xd >= 0 && xd - k > M) xd = -1;
+      if (xr >= 0 && ++xr > N) xr = -1;
+      int x = xd > xr ? xd : xr;
+      if (x < 0) {
+        Bd[k] = -1;
+        continue;
+      }
+      int y = x - k;
+      while (x < N && y < M && A[ahi - 1 - x] == B[bhi - 1 - y]) x++, y++;
+      Bd[k] = x;
+      int kf = delta - k;
+      if (!odd && kf >= -d && kf <= d && Fd[kf] >= 0 && x + Fd[kf] >= N) {
+        *xmid = ahi - x;
+        *ymid = bhi - y;
+        return;
+      }
+    }
+    // Too expensive to be exact, settle for the forward path that got furthest
+    if (d >= KILO_DIFF_COST) {
+      int best = -1;
+      for (int k = -d; k <= d; k += 2) {
+        if (Fd[k] < 0) continue;
+        if (best == -1 || 2 * Fd[k] - k > 2 * Fd[best] - best) best = k;
+      }
+      *xmid = alo + Fd[best];
+      *ymid = blo + Fd[best] - best;
+      return;
+    }
+  }
+  // Unreachable, the searches always meet by d = max
+  *xmid = alo;
+  *ymid = blo;
+}
+
+// Mark the lines of a[alo..ahi) and b[blo..bhi) that are not part of the common subsequence
+void editorDiffCompare(struct diffSeq *q, int alo, int ahi, int blo, int bhi) {
+  while (alo < ahi && blo < bhi && q->a[alo] == q->b[blo]) alo++, blo++;
+  while (alo < ahi && blo < bhi && q->a[ahi - 1] == q->b[bhi - 1]) ahi--, bhi--;
+  if (alo == ahi) {
+    while (blo < bhi) q->bchg[blo++] = 1;
+  } else if (blo == bhi) {
+    while (alo < ahi) q->achg[alo++] = 1;
   } else {
-    E.cx = saved_cx;
-    E.cy = saved_cy;
-    E.coloff = saved_coloff;
-    E.rowoff = saved_rowoff;
+    int x, y;
+    editorDiffSplit(q, alo, ahi, blo, bhi, &x, &y);
+    editorDiffCompare(q, alo, x, blo, y);
+    editorDiffCompare(q, x, ahi, y, bhi);
   }
 }
 
-/*** append buffer ***/
+// Lines found on only one side are changes whatever else happens, so they are dropped
+// before the diff runs. What is left is usually far shorter than either file
+void editorDiffMark(struct diffSide *a, struct diffSide *b, char *achg, char *bchg) {
+  int ids = editorDiffNumber(a, b);
+  int *ina = calloc(ids, sizeof(int)), *inb = calloc(ids, sizeof(int));
+  for (int j = 0; j < a->n; j++) ina[a->lines[j].id] = 1;
+  for (int j = 0; j < b->n; j++) inb[b->lines[j].id] = 1;
+
+  struct diffSeq q;
+  int *amap = malloc(sizeof(int) * (a->n + 1)), *bmap = malloc(sizeof(int) * (b->n + 1));
+  q.a = malloc(sizeof(int) * (a->n + 1));
+  q.b = malloc(sizeof(int) * (b->n + 1));
+  int na = 0, nb = 0;
+  for (int j = 0; j < a->n; j++) {
+    achg[j] = !inb[a->lines[j].id];
+    if (!achg[j]) {
+      amap[na] = j;
+      q.a[na++] = a->lines[j].id;
+    }
+  }
+  for (int j = 0; j < b->n; j++) {
+    bchg[j] = !ina[b->lines[j].id];
+    if (!bchg[j]) {
+      bmap[nb] = j;
+      q.b[nb++] = b->lines[j].id;
+    }
+  }
+  free(ina);
+  free(inb);
+
+  q.achg = calloc(na + 1, 1);
+  q.bchg = calloc(nb + 1, 1);
+  // One pair of diagonal arrays serves every level of the recursion
+  int diags = na + nb + 3;
+  int *fd = malloc(sizeof(int) * (2 * diags + 1)), *bd = malloc(sizeof(int) * (2 * diags + 1));
+  q.fd = fd + diags;
+  q.bd = bd + diags;
+  editorDiffCompare(&q, 0, na, 0, nb);
+
+  for (int j = 0; j < na; j++) achg[amap[j]] = q.achg[j];
+  for (int j = 0; j < nb; j++) bchg[bmap[j]] = q.bchg[j];
+  free(fd);
+  free(bd);
+  free(q.a);
+  free(q.b);
+  free(q.achg);
+  free(q.bchg);
+  free(amap);
+  free(bmap);
+}
 
-struct abuf {
-  char *b;
-  int len;
-};
+// Line the two files up: unchanged lines side by side, changed runs next to each other
+void editorDiffAlign(char *achg, char *bchg) {
+  struct editorDiff *df = &E.diff;
+  int na = df->a.n, nb = df->b.n;
+  int cap = (na > nb ? na : nb) + 16;
+  df->pairs = malloc(sizeof(struct diffPair) * cap);
+  df->npairs = 0;
+  df->hunks = NULL;
+  df->nhunks = 0;
+  int hcap = 0;
+  int i = 0, j = 0;
+  while (i < na || j < nb) {
+    if (i < na && j < nb && !achg[i] && !bchg[j]) {
+      if (df->npairs == cap) {
+        cap *= 2;
+        df->pairs = realloc(df->pairs, sizeof(struct diffPair) * cap);
+      }
+      df->pairs[df->npairs++] = (struct diffPair){ i++, j++, 0 };
+      continue;
+    }
+    int la = 0, lb = 0;
+    while (i + la < na && achg[i + la]) la++;
+    while (j + lb < nb && bchg[j + lb]) lb++;
+    int n = la > lb ? la : lb;
+    if (df->nhunks == hcap) {
+      hcap = hcap ? hcap * 2 : 64;
+      df->hunks = realloc(df->hunks, sizeof(int) * hcap);
+    }
+    df->hunks[df->nhunks++] = df->npairs;
+    if (df->npairs + n > cap) {
+      cap = (df->npairs + n) * 2;
+      df->pairs = realloc(df->pairs, sizeof(struct diffPair) * cap);
+    }
+    for (int k = 0; k < n; k++) {
+      df->pairs[df->npairs++] = (struct diffPair){ k < la ? i + k : -1, k < lb ? j + k : -1, 1 };
+    }
+    i += la;
+    j += lb;
+  }
+}
 
-#define ABUF_INIT {NULL, 0}
+void editorDiffOpen(const char *patha, const char *pathb) {
+  struct editorDiff *df = &E.diff;
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  editorDiffLoad(&df->a, patha);
+  editorDiffLoad(&df->b, pathb);
+  char *achg = malloc(df->a.n + 1), *bchg = malloc(df->b.n + 1);
+  editorDiffMark(&df->a, &df->b, achg, bchg);
+  editorDiffAlign(achg, bchg);
+  free(achg);
+  free(bchg);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  long ms = (t1.tv_sec - t0.tv_sec) * 1000 + (t1.tv_nsec - t0.tv_nsec) / 1000000;
+  df->active = 1;
+  E.readonly = 1;
+  E.numrows = 0;
+  if (df->nhunks) E.cy = df->hunks[0];
+  editorSetStatusMessage("%d differences in %ld ms | n = next | p = previous | Ctrl-Q = quit", df->nhunks, ms);
+}
 
-// Append to buffer to prevent small flickers between writes
-void abAppend(struct abuf *ab, const char *s, int len) {
-  // Allocate memory to hold new string
-  char *new = realloc(ab->b, ab->len + len);
+// Draw width columns of a line, expanding tabs and skipping the first coloff columns.
+// A missing line on one side of a change is drawn as blanks
+void editorDiffDrawText(struct abuf *ab, struct diffLine *l, int width) {
+  int col = 0, shown = 0;
+  for (int j = 0; l && j < l->len && shown < width; j++) {
+    char c = l->s[j];
+    int n = 1;
+    if (c == '\t') {
+      n = KILO_TAB_STOP - col % KILO_TAB_STOP;
+      c = ' ';
+    } else if (iscntrl((unsigned char)c)) {
+      c = '?';
+    }
+    while (n-- && shown < width) {
+      if (col++ >= E.coloff) {
+        abAppend(ab, &c, 1);
+        shown++;
+      }
+    }
+  }
+  while (shown++ < width) abAppend(ab, " ", 1);
+}
 
-  if (new == NULL) return;
-  // Copy string s after end of current data in buffer
-  memcpy(&new[ab->len], s, len);
-  ab->b = new;
-  ab->len += len;
+// Both files side by side, removed lines red, added lines green and changed pairs yellow
+void editorDiffDrawRows(struct abuf *ab) {
+  struct editorDiff *df = &E.diff;
+  int width = (E.screencols - 1) / 2;
+  for (int y = 0; y < E.screenrows; y++) {
+    int p = y + E.rowoff;
+    if (p >= df->npairs) {
+      abAppend(ab, "~", 1);
+    } else {
+      struct diffPair *pr = &df->pairs[p];
+      int color = !pr->changed ? 39 : pr->a < 0 ? 32 : pr->b < 0 ? 31 : 33;
+      char buf[16];
+      int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
+      abAppend(ab, buf, clen);
+      editorDiffDrawText(ab, pr->a >= 0 ? &df->a.lines[pr->a] : NULL, width);
+      // Changed pairs get an inverted bar down the middle so they can be spotted without colour
+      abAppend(ab, pr->changed ? "\x1b[7m|\x1b[27m" : "|", pr->changed ? 10 : 1);
+      editorDiffDrawText(ab, pr->b >= 0 ? &df->b.lines[pr->b] : NULL, E.screencols - 1 - width);
+      abAppend(ab, "\x1b[39m", 5);
+    }
+    abAppend(ab, "\x1b[K", 3);
+    abAppend(ab, "\r\n", 2);
+  }
 }
 
-// Deallocates dynamic memory used by struct abuf
-void abFree(struct abuf *ab) {
-  free(ab->b);
+// Move between pairs and hunks, returns 0 if the key should get its normal meaning
+int editorDiffProcessKey(int c) {
+  struct editorDiff *df = &E.diff;
+  int last = df->npairs ? df->npairs - 1 : 0;
+  switch (c) {
+    case ARROW_UP: if (E.cy > 0) E.cy--; break;
+    case ARROW_DOWN: if (E.cy < last) E.cy++; break;
+    case ARROW_LEFT: if (E.coloff > 0) E.coloff--; break;
+    case ARROW_RIGHT: E.coloff++; break;
+    case HOME_KEY: E.coloff = 0; break;
+    case PAGE_UP:
+      E.cy = E.cy > E.screenrows ? E.cy - E.screenrows : 0;
+      break;
+    case PAGE_DOWN:
+      E.cy = E.cy + E.screenrows < last ? E.cy + E.screenrows : last;
+      break;
+    case 'n':
+    case 'p': {
+      // Hunks are in order, so binary search for the one after or before the cursor
+      int lo = 0, hi = df->nhunks;
+      while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (df->hunks[mid] <= E.cy) lo = mid + 1;
+        else hi = mid;
+      }
+      int h = c == 'n' ? lo : lo - 1;
+      if (c == 'p' && h >= 0 && df->hunks[h] == E.cy) h--;
+      if (h < 0 || h >= df->nhunks) {
+        editorSetStatusMessage("No more differences");
+        break;
+      }
+      E.cy = df->hunks[h];
+      // Show some context above the hunk
+      E.rowoff = E.cy > E.screenrows / 4 ? E.cy - E.screenrows / 4 : 0;
+      break;
+    }
+    case CTRL_KEY('s'):
+    case CTRL_KEY('r'):
+    case CTRL_KEY('f'):
+      editorSetStatusMessage("Not available in diff view");
+      break;
+    default: return 0;
+  }
+  return 1;
 }
 
 /*** output ***/
 
 void editorScroll() {
+  // Whatever put the cursor inside a fold, the fold opens to show it
+  struct foldNode *f = editorFoldFind(E.cy);
+  if (f) editorFoldRemove(f);
+  // rowoff counts shown rows, so folded ones take no room
+  int vy = editorFoldRowToVisible(E.cy);
+  // A frozen header row is always drawn, the other rows scroll below it
+  int top = editorCsvHeaderLines();
+  if (vy >= top && vy - top < E.rowoff) {
+    E.rowoff = vy - top;
+  }
+  if (vy >= E.rowoff + E.screenrows) {
+    E.rowoff = vy - E.screenrows + 1;
+  }
+
+  // Both panes of a diff share coloff, the arrow keys move it directly
+  if (E.diff.active) return;
+
   E.rx = 0;
+  if (E.csv.delim) editorCsvLayout();
   if (E.cy < E.numrows) {
-    E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+    E.rx = E.csv.delim ? editorCsvCxToRx(&E.row[E.cy], E.cx) : editorRowCxToRx(&E.row[E.cy], E.cx);
   }
 
-  if (E.cy < E.rowoff) {
-    E.rowoff = E.cy;
-  }
-  if (E.cy >= E.rowoff + E.screenrows) {
-    E.rowoff = E.cy - E.screenrows + 1;
-  }
   if (E.rx < E.coloff) {
     E.coloff = E.rx;
   }
@@ -844,10 +6961,15 @@ void editorScroll() {
 
 // Draw column of tildas on left hand side of screen
 void editorDrawRows(struct abuf *ab) {
+  if (E.diff.active) {
+    editorDiffDrawRows(ab);
+    return;
+  }
   int y;
+  int top = editorCsvHeaderLines();
   for (y = 0; y < E.screenrows; y++) {
-    // Check if currently draw row part of text buffer
-    int filerow = y + E.rowoff;
+    // Check if currently draw row part of text buffer, rows folded away are skipped
+    int filerow = y < top ? y : editorFoldVisibleToRow(y + E.rowoff);
     if (filerow >= E.numrows) {
       if (E.numrows == 0 && y == E.screenrows / 3) {
         // Print welcome message a third of the way down screen
@@ -867,16 +6989,32 @@ void editorDrawRows(struct abuf *ab) {
         abAppend(ab, "~", 1);
       }
     } else {
+      char *c = E.row[filerow].render;
+      unsigned char *hl = E.row[filerow].hl;
+      int len = E.row[filerow].rsize;
+      // Tabular files are drawn from a copy with the fields lined up
+      if (E.csv.delim) len = editorCsvRender(&E.row[filerow], &c, &hl);
+      // Header row stands out in bold
+      if (y < top) abAppend(ab, "\x1b[1m", 4);
       // Truncate line if it goes past the end of screen
-      int len = E.row[filerow].rsize - E.coloff;
+      len -= E.coloff;
       if (len < 0) len = 0;
       if (len > E.screencols) len = E.screencols;
-      char *c = &E.row[filerow].render[E.coloff];
+      c = &c[E.coloff];
       // Get pointer with part of hl array that corresponds to current part of render
-      unsigned char *hl = &E.row[filerow].hl[E.coloff];
+      hl = &hl[E.coloff];
       int current_color = -1; // -1 for default
+      // Other cursors on the row are drawn in inverted colors
+      int ci = E.cursors.n ? editorCursorsFrom(filerow) : 0;
+      int crx = E.cursors.n ? editorCursorsNextRx(&ci, filerow) : -1;
+      // So is the selection
+      int srx, erx;
+      editorSelectionRx(filerow, &srx, &erx);
       int j;
       for (j = 0; j < len; j++) {
+        while (crx != -1 && crx < j + E.coloff) crx = editorCursorsNextRx(&ci, filerow);
+        int mark = crx == j + E.coloff || (j + E.coloff >= srx && j + E.coloff < erx);
+        if (mark) abAppend(ab, "\x1b[7m", 4);
         if (iscntrl(c[j])) { // Check if current character is control value
           // Translate into printable character by adding value to '@' (capital letters) or '?' if not in alphabetic range
           char sym = (c[j] <= 26) ? '@' + c[j] : '?';
@@ -907,8 +7045,22 @@ void editorDrawRows(struct abuf *ab) {
           }
           abAppend(ab, &c[j], 1);
         }
+        if (mark) abAppend(ab, "\x1b[27m", 5);
       }
+      while (crx != -1 && crx < len + E.coloff) crx = editorCursorsNextRx(&ci, filerow);
+      if (crx == len + E.coloff && len < E.screencols) abAppend(ab, "\x1b[7m \x1b[27m", 10);
       abAppend(ab, "\x1b[39m", 5);
+      if (y < top) abAppend(ab, "\x1b[22m", 5);
+      // A folded line says how much is hidden under it
+      struct foldNode *f = editorFoldFind(filerow + 1);
+      if (f && f->start == filerow + 1 && len < E.screencols - 1) {
+        char buf[32];
+        int flen = snprintf(buf, sizeof(buf), " [+%d]", f->end - f->start + 1);
+        if (flen > E.screencols - 1 - len) flen = E.screencols - 1 - len;
+        abAppend(ab, "\x1b[2m", 4);
+        abAppend(ab, buf, flen);
+        abAppend(ab, "\x1b[22m", 5);
+      }
     }
 
     abAppend(ab, "\x1b[K", 3);
@@ -919,8 +7071,36 @@ void editorDrawRows(struct abuf *ab) {
 void editorDrawStatusBar(struct abuf *ab) {
   abAppend(ab, "\x1b[7m", 4);
   char status[80], rstatus[80];
-  int len = snprintf(status, sizeof(status), "%.20s - %d lines %s", E.filename ? E.filename : "[No Name]", E.numrows, E.dirty ? "(modified)" : "");
-  int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d", E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.numrows);
+  struct statCount total = editorStatsRange(0, 0, E.numrows, 0);
+  int len = snprintf(status, sizeof(status), "%.20s - %d lines %lld words %lld bytes %s", E.filename ? E.filename : "[No Name]",
+    E.numrows, total.words, total.bytes, E.dirty ? "(modified)" : E.follow.active ? "(following)" : "");
+  if (len >= (int)sizeof(status)) len = sizeof(status) - 1;
+  int rlen;
+  if (E.hex.active) {
+    len = snprintf(status, sizeof(status), "%.20s - %zu bytes (hex)", E.filename, E.hex.size);
+    rlen = snprintf(rstatus, sizeof(rstatus), "0x%zx/0x%zx", E.hex.cur, E.hex.size);
+  } else if (E.diff.active) {
+    struct editorDiff *df = &E.diff;
+    len = snprintf(status, sizeof(status), "%.20s | %.20s - %d differences", df->a.name, df->b.name, df->nhunks);
+    struct diffPair *pr = df->npairs ? &df->pairs[E.cy] : NULL;
+    rlen = snprintf(rstatus, sizeof(rstatus), "diff | %d,%d", pr && pr->a >= 0 ? pr->a + 1 : 0,
+      pr && pr->b >= 0 ? pr->b + 1 : 0);
+  } else {
+    rlen = snprintf(rstatus, sizeof(rstatus), "%s%s%s | %d/%d", E.encoding != ENC_UTF8 ? editorEncodingName(E.encoding) : "",
+      E.encoding != ENC_UTF8 ? " | " : "", E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.numrows);
+    if (E.csv.delim && E.cy < E.numrows) {
+      erow *row = &E.row[E.cy];
+      int k = editorCsvFieldAt(row, E.cx);
+      rlen += snprintf(rstatus + rlen, sizeof(rstatus) - rlen, " | field %d/%d", k + 1, row->nfields);
+    }
+    if (E.cursors.n) rlen += snprintf(rstatus + rlen, sizeof(rstatus) - rlen, " | %d cursors", E.cursors.n);
+    int sr, sc, er, ec;
+    if (editorSelectionRange(&sr, &sc, &er, &ec)) {
+      struct statCount sel = editorStatsRange(sr, sc, er, ec);
+      rlen += snprintf(rstatus + rlen, sizeof(rstatus) - rlen, " | sel %dL %lldW %lldB", er - sr + (ec > 0), sel.words, sel.bytes);
+    }
+    if (rlen >= (int)sizeof(rstatus)) rlen = sizeof(rstatus) - 1;
+  }
   if (len > E.screencols) len = E.screencols;
   abAppend(ab, status, len);
   while (len < E.screencols) {
@@ -947,20 +7127,32 @@ void editorDrawMessageBar(struct abuf *ab) {
 
 // Refreshes screen by writing escape sequence to terminal after each keypress
 void editorRefreshScreen() {
-  editorScroll();
+  if (E.batch.active) return;
+  // A prompt in the middle of an edit draws rows it has already changed
+  editorEditFlush();
+  if (E.hex.active) editorHexScroll();
+  else editorScroll();
 
   struct abuf ab = ABUF_INIT;
 
   abAppend(&ab, "\x1b[?25l", 6);
   abAppend(&ab, "\x1b[H", 3);
 
-  editorDrawRows(&ab);
+  if (E.hex.active) editorHexDrawRows(&ab);
+  else editorDrawRows(&ab);
   editorDrawStatusBar(&ab);
   editorDrawMessageBar(&ab);
 
   // Reposition cursor on screen
   char buf[32];
-  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1, (E.rx - E.coloff) + 1);
+  if (E.hex.active) {
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (int)((E.hex.cur - E.hex.top) / KILO_HEX_WIDTH) + 1, editorHexCursorCol() + 1);
+  } else if (E.diff.active) {
+    snprintf(buf, sizeof(buf), "\x1b[%d;1H", E.cy - E.rowoff + 1);
+  } else {
+    int y = E.cy < editorCsvHeaderLines() ? E.cy : editorFoldRowToVisible(E.cy) - E.rowoff;
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, (E.rx - E.coloff) + 1);
+  }
   abAppend(&ab, buf, strlen(buf));
 
   abAppend(&ab, "\x1b[?25h", 6);
@@ -981,6 +7173,16 @@ void editorSetStatusMessage(const char *fmt, ...) {
 
 /*** input ***/
 
+// Service background work while waiting for a key, returns 1 if the screen needs redrawing
+int editorIdle() {
+  int redraw = 0;
+  redraw |= editorPollSave();
+  redraw |= editorPollStream();
+  redraw |= editorPollFollow();
+  redraw |= editorPollWatch();
+  return redraw;
+}
+
 // Take callback function, which will be called after each keypress
 char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
   size_t bufsize = 128;
@@ -1023,6 +7225,22 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
   }
 }
 
+// Ask a yes/no question in the status bar
+int editorConfirm(const char *fmt, ...) {
+  char msg[80];
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(msg, sizeof(msg), fmt, ap);
+  va_end(ap);
+  while (1) {
+    editorSetStatusMessage("%s", msg);
+    editorRefreshScreen();
+    int c = editorReadKey();
+    if (c == 'y' || c == 'Y') return 1;
+    if (c == 'n' || c == 'N' || c == '\x1b' || c == CTRL_KEY('q')) return 0;
+  }
+}
+
 void editorMoveCursor(int key) {
 erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
 
@@ -1031,7 +7249,7 @@ erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
       if (E.cx != 0) {
         E.cx--;
       } else if (E.cy > 0) { // Move left at the start of a line
-        E.cy--;
+        E.cy = editorFoldSkip(E.cy - 1, -1);
         E.cx = E.row[E.cy].size;
       }
       break;
@@ -1040,18 +7258,18 @@ erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
       if (row && E.cx < row->size) {
         E.cx++;
       } else if (row && E.cx == row->size) {
-        E.cy++;
+        E.cy = editorFoldSkip(E.cy + 1, 1);
         E.cx = 0;
       }
       break;
     case ARROW_UP:
       if (E.cy != 0) {
-        E.cy--;
+        E.cy = editorFoldSkip(E.cy - 1, -1);
       }
       break;
     case ARROW_DOWN:
       if (E.cy  < E.numrows) {
-        E.cy++;
+        E.cy = editorFoldSkip(E.cy + 1, 1);
       }
       break;
   }
@@ -1064,28 +7282,64 @@ erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
   }
 }
 
+// Refuse edits to a read-only buffer, returns 1 if editing is allowed
+int editorCanEdit() {
+  if (E.stream.loading) {
+    editorSetStatusMessage("Editing is disabled until %s has finished loading", E.filename);
+    return 0;
+  }
+  if (E.readonly) {
+    editorSetStatusMessage("Buffer is read-only%s", E.follow.active ? " in follow mode" : E.hex.active ? " in hex view" :
+      E.diff.active ? " in diff view" : "");
+    return 0;
+  }
+  return 1;
+}
+
 // Waits for a keypress, then handles it
 void editorProcessKeypress() {
   static int quit_times = KILO_QUIT_TIMES;
   int c = editorReadKey();
+  if (E.hex.active && editorHexProcessKey(c)) return;
+  if (E.diff.active && editorDiffProcessKey(c)) return;
+  // The keypress is one edit and one undo step
+  editorBeginEdit();
+  // Only the key right after a paste can swap it for an older one
+  int yanked = E.kill.yank;
+  E.kill.yank = -1;
+  // With several cursors, typing and moving act on all of them
+  if (E.cursors.n && editorCursorsProcessKey(c)) {
+    editorCommitEdit();
+    quit_times = KILO_QUIT_TIMES;
+    if (E.dirty && E.saved_valid && E.doc_hash == E.saved_hash && E.numrows == E.saved_rows) E.dirty = 0;
+    return;
+  }
   switch (c) {
     case '\r':
-      editorInsertNewline();
+      if (editorCanEdit()) editorInsertNewline();
       break;
 
     case CTRL_KEY('q'):
+      // A script ends when its keys run out
+      if (E.batch.active) break;
       if (E.dirty && quit_times > 0) {
         editorSetStatusMessage("WARNING! File has unsaved changes. Press Ctrl-Q %d more times to quit.", quit_times);
         quit_times--;
+        // Skips the end of the keypress so the count isn't reset, but the edit still ends
+        editorCommitEdit();
         return;
       }
+      // Don't let a half written temporary file be the last thing that happens
+      editorWaitSave();
+      // Quitting on purpose, nothing to recover
+      editorJournalStop(1);
       write(STDOUT_FILENO, "\x1b[2J", 4);
       write(STDOUT_FILENO, "\x1b[H", 3);
       exit(0);
       break;
 
     case CTRL_KEY('s'):
-      editorSave();
+      if (editorCanEdit()) editorSave();
       break;
 
     // Move cursor to left or right of page
@@ -1102,21 +7356,44 @@ void editorProcessKeypress() {
       editorFind();
       break;
 
+    case CTRL_KEY('r'):
+      if (editorCanEdit()) editorReload();
+      break;
+
     case BACKSPACE:
     case CTRL_KEY('h'):
     case DEL_KEY:
+      if (!editorCanEdit()) break;
       if (c == DEL_KEY) editorMoveCursor(ARROW_RIGHT);
+      E.undo.typing = 1;
       editorDelChar();
       break;
 
+    // Cursor at each match of a search, or one more on the next line
+    case CTRL_KEY('d'):
+      editorCursorsFind();
+      break;
+
+    case CTRL_KEY('e'):
+      editorCursorsAddBelow();
+      break;
+
+    case CTRL_KEY('z'):
+      if (editorCanEdit()) editorUndo();
+      break;
+
+    case CTRL_KEY('y'):
+      if (editorCanEdit()) editorRedo();
+      break;
+
     // Move cursor to top or bottom of page
     case PAGE_UP:
     case PAGE_DOWN:
       {
         if (c == PAGE_UP) {
-          E.cy = E.rowoff;
+          E.cy = editorFoldVisibleToRow(E.rowoff);
         } else if (c == PAGE_DOWN) {
-          E.cy = E.rowoff + E.screenrows - 1;
+          E.cy = editorFoldVisibleToRow(E.rowoff + E.screenrows - 1);
           if (E.cy > E.numrows) E.cy = E.numrows;
         }
 
@@ -1133,16 +7410,400 @@ void editorProcessKeypress() {
       editorMoveCursor(c);
       break;
 
-    case CTRL_KEY('l'):
+    case CTRL_ARROW_LEFT:
+    case CTRL_ARROW_RIGHT:
+      editorCsvMoveField(c);
+      break;
+
+    // Freeze or unfreeze the header row of a CSV/TSV file
+    case CTRL_KEY('k'):
+      if (!E.csv.delim) break;
+      E.csv.header = !E.csv.header;
+      editorSetStatusMessage("Header row %s", E.csv.header ? "frozen" : "scrolls with the file");
+      break;
+
+    // Select, copy, cut and paste through the kill ring
+    case CTRL_KEY('b'):
+      E.sel.active = !E.sel.active;
+      E.sel.cy = E.cy;
+      E.sel.cx = E.cx;
+      if (E.sel.active) editorSetStatusMessage("Selection started");
+      break;
+
+    case CTRL_KEY('c'):
+    case CTRL_KEY('x'):
+      editorCopy(c == CTRL_KEY('x'));
+      break;
+
+    case CTRL_KEY('p'):
+      editorCommand();
+      break;
+
+    case CTRL_KEY('t'):
+      editorFoldToggle();
+      break;
+
+    // Bookmarks and the jump list
+    case CTRL_KEY('g'):
+      editorBookmarkToggle();
+      break;
+
+    case CTRL_KEY('n'):
+      editorBookmarkNext();
+      break;
+
+    case CTRL_KEY('o'):
+      editorJumpBack();
+      break;
+
+    case CTRL_KEY('u'):
+      editorJumpForward();
+      break;
+
+    case CTRL_KEY('v'):
+      if (editorCanEdit()) editorPaste();
+      break;
+
+    case CTRL_KEY('w'):
+      if (editorCanEdit()) editorPasteOlder(yanked);
+      break;
+
     case '\x1b':
+      E.sel.active = 0;
+      break;
+
+    case CTRL_KEY('l'):
       break;
 
     default:
+      if (!editorCanEdit()) break;
+      E.undo.typing = 1;
       editorInsertChar(c);
       break;
   }
 
+  editorCommitEdit();
   quit_times = KILO_QUIT_TIMES;
+  // Edits that cancel out (type then backspace) leave nothing to save
+  if (E.dirty && E.saved_valid && E.doc_hash == E.saved_hash && E.numrows == E.saved_rows) E.dirty = 0;
+}
+
+/*** batch mode ***/
+
+enum batchOp {
+  B_GOTO = 1,
+  B_INSERT,
+  B_NEWLINE,
+  B_BACKSPACE,
+  B_DELETELINE,
+  B_REPLACE,
+  B_KEYS,
+  B_SAVE
+};
+
+// One line of a batch script
+struct batchCmd {
+  int op;
+  int row, col, n;
+  char *text; // Text to insert, keys to press or the string to replace
+  size_t len;
+  char *with; // Replacement for replace
+  size_t withlen;
+};
+
+// Progress shared by every worker process
+struct batchStats {
+  int next; // Next file to hand out
+  int done;
+  int failed;
+  long long bytes;
+};
+
+// Decode \n, \t, \r, \e, \\ and \xHH in place, returns the new length
+size_t editorBatchUnescape(char *s, size_t len) {
+  size_t i = 0, o = 0;
+  while (i < len) {
+    if (s[i] != '\\' || i + 1 == len) {
+      s[o++] = s[i++];
+      continue;
+    }
+    char c = s[i + 1];
+    i += 2;
+    switch (c) {
+      case 'n': s[o++] = '\n'; break;
+      case 't': s[o++] = '\t'; break;
+      case 'r': s[o++] = '\r'; break;
+      case 'e': s[o++] = '\x1b'; break;
+      case 'x':
+        if (i + 1 < len && isxdigit((unsigned char)s[i]) && isxdigit((unsigned char)s[i + 1])) {
+          char hex[3] = { s[i], s[i + 1], '\0' };
+          s[o++] = strtol(hex, NULL, 16);
+          i += 2;
+          break;
+        }
+        s[o++] = c;
+        break;
+      default: s[o++] = c; break;
+    }
+  }
+  return o;
+}
+
+// Read a script into commands, exits with a message on the first bad line
+struct batchCmd *editorBatchParse(const char *path, int *count) {
+  FILE *fp = fopen(path, "r");
+  if (!fp) die(path);
+  struct batchCmd *cmds = NULL;
+  int n = 0, lineno = 0;
+  char *line = NULL;
+  size_t cap = 0;
+  ssize_t len;
+  while ((len = getline(&line, &cap, fp)) != -1) {
+    lineno++;
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) line[--len] = '\0';
+    char *p = line;
+    while (isspace((unsigned char)*p)) p++;
+    if (*p == '\0' || *p == '#') continue;
+    char *arg = p;
+    while (*arg && !isspace((unsigned char)*arg)) arg++;
+    size_t wlen = arg - p;
+    if (*arg) arg++;
+
+    struct batchCmd c = { 0, 0, 0, 1, NULL, 0, NULL, 0 };
+    if (!strncmp(p, "goto", wlen) && wlen == 4) {
+      c.op = B_GOTO;
+      c.col = 1;
+      if (sscanf(arg, "%d %d", &c.row, &c.col) < 1) c.op = 0;
+    } else if (!strncmp(p, "insert", wlen) && wlen == 6) {
+      c.op = B_INSERT;
+    } else if (!strncmp(p, "newline", wlen) && wlen == 7) {
+      c.op = B_NEWLINE;
+    } else if (!strncmp(p, "backspace", wlen) && wlen == 9) {
+      c.op = B_BACKSPACE;
+      if (*arg && sscanf(arg, "%d", &c.n) != 1) c.op = 0;
+    } else if (!strncmp(p, "deleteline", wlen) && wlen == 10) {
+      c.op = B_DELETELINE;
+      if (*arg && sscanf(arg, "%d", &c.n) != 1) c.op = 0;
+    } else if (!strncmp(p, "replace", wlen) && wlen == 7) {
+      // replace /old/new/, any character can stand in for the slashes
+      c.op = B_REPLACE;
+      char d = *arg;
+      char *mid = d ? strchr(arg + 1, d) : NULL;
+      char *end = mid ? strchr(mid + 1, d) : NULL;
+      if (!end || mid == arg + 1) {
+        c.op = 0;
+      } else {
+        c.text = strndup(arg + 1, mid - arg - 1);
+        c.len = editorBatchUnescape(c.text, mid - arg - 1);
+        c.with = strndup(mid + 1, end - mid - 1);
+        c.withlen = editorBatchUnescape(c.with, end - mid - 1);
+      }
+    } else if (!strncmp(p, "keys", wlen) && wlen == 4) {
+      c.op = B_KEYS;
+    } else if (!strncmp(p, "save", wlen) && wlen == 4) {
+      c.op = B_SAVE;
+    }
+    if (c.op == B_INSERT || c.op == B_KEYS) {
+      c.text = strdup(arg);
+      c.len = editorBatchUnescape(c.text, strlen(arg));
+    }
+    if (c.op == 0) {
+      fprintf(stderr, "%s:%d: can't understand: %s\n", path, lineno, p);
+      exit(2);
+    }
+    cmds = realloc(cmds, sizeof(struct batchCmd) * (n + 1));
+    cmds[n++] = c;
+  }
+  free(line);
+  fclose(fp);
+  *count = n;
+  return cmds;
+}
+
+// Replace every occurrence of a string in every row
+void editorBatchReplace(struct batchCmd *c) {
+  if (c->len == 0) return;
+  for (int j = 0; j < E.numrows; j++) {
+    erow *row = &E.row[j];
+    char *hit = memmem(row->chars, row->size, c->text, c->len);
+    if (!hit) continue;
+    // Rebuild the row from the first match on, then record it as truncate and append
+    int first = hit - row->chars;
+    size_t cap = row->size + c->withlen + 1, len = 0;
+    char *tail = malloc(cap);
+    char *p = hit, *end = row->chars + row->size;
+    while (p < end) {
+      char *m = memmem(p, end - p, c->text, c->len);
+      size_t keep = (m ? m : end) - p;
+      size_t need = len + keep + (m ? c->withlen : 0);
+      if (need > cap) {
+        cap = need * 2;
+        tail = realloc(tail, cap);
+      }
+      memcpy(&tail[len], p, keep);
+      len += keep;
+      if (!m) break;
+      memcpy(&tail[len], c->with, c->withlen);
+      len += c->withlen;
+      p = m + c->len;
+    }
+    editorRowTruncate(row, first);
+    editorRowAppendString(row, tail, len);
+    free(tail);
+  }
+}
+
+// Run the script against the loaded file
+void editorBatchRun(struct batchCmd *cmds, int count) {
+  for (int i = 0; i < count; i++) {
+    struct batchCmd *c = &cmds[i];
+    // Keys are keypresses, each its own edit
+    if (c->op == B_KEYS) {
+      E.batch.keys = c->text;
+      E.batch.nkeys = c->len;
+      E.batch.pos = 0;
+      while (E.batch.pos < E.batch.nkeys) editorProcessKeypress();
+      E.batch.nkeys = 0;
+      continue;
+    }
+    // Any other command is one edit, and one step for a ^Z in a later keys command
+    editorBeginEdit();
+    switch (c->op) {
+      case B_GOTO:
+        E.cy = c->row - 1;
+        if (E.cy < 0) E.cy = 0;
+        if (E.cy > E.numrows) E.cy = E.numrows;
+        E.cx = c->col - 1;
+        if (E.cx < 0) E.cx = 0;
+        if (E.cx > (E.cy < E.numrows ? E.row[E.cy].size : 0)) E.cx = E.cy < E.numrows ? E.row[E.cy].size : 0;
+        break;
+      case B_INSERT:
+        for (size_t k = 0; k < c->len; k++) {
+          if (c->text[k] == '\n') editorInsertNewline();
+          else editorInsertChar(c->text[k]);
+        }
+        break;
+      case B_NEWLINE:
+        editorInsertNewline();
+        break;
+      case B_BACKSPACE:
+        for (int k = 0; k < c->n; k++) editorDelChar();
+        break;
+      case B_DELETELINE:
+        for (int k = 0; k < c->n && E.cy < E.numrows; k++) editorDelRow(E.cy);
+        E.cx = 0;
+        break;
+      case B_REPLACE:
+        editorBatchReplace(c);
+        break;
+      case B_SAVE:
+        editorSave();
+        editorWaitSave();
+        break;
+    }
+    editorCommitEdit();
+  }
+}
+
+// Open, edit and save one file. Returns -1 and prints why if it can't be done
+int editorBatchFile(char *path, struct batchCmd *cmds, int count) {
+  // Clear out the previous file
+  editorDelRows(0, E.numrows);
+  editorUndoClear();
+  // Text cut from the last file, and a selection left on, would change what the keys do here
+  for (int k = 0; k < KILO_KILL_RING; k++) editorKillFree(&E.kill.ring[k]);
+  E.kill.n = 0;
+  E.kill.head = 0;
+  E.kill.yank = -1;
+  E.sel.active = 0;
+  // Nor should positions kept on the last file's lines
+  editorMarkClear();
+  editorFoldClear();
+  E.cursors.n = 0;
+  E.cursors.primary = 0;
+  E.cx = E.cy = E.rx = 0;
+  E.rowoff = E.coloff = 0;
+  E.dirty = 0;
+  E.disk_valid = 0;
+  E.saved_valid = 0;
+  E.crlf = 0;
+  E.doc_hash = 0;
+  E.statusmsg[0] = '\0';
+
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+    fprintf(stderr, "gram: %s: %s\n", path, fd == -1 ? strerror(errno) : "not a regular file");
+    if (fd != -1) close(fd);
+    return -1;
+  }
+  close(fd);
+  editorOpen(path);
+  if (E.hex.active) {
+    if (E.hex.map) munmap(E.hex.map, E.hex.size);
+    E.hex.active = 0;
+    E.readonly = 0;
+    fprintf(stderr, "gram: %s: binary file, skipped\n", path);
+    return -1;
+  }
+  editorBatchRun(cmds, count);
+  // A Ctrl-S among the keys may have left a save running
+  editorWaitSave();
+  if (E.dirty) {
+    editorSave();
+    editorWaitSave();
+    if (E.dirty) {
+      fprintf(stderr, "gram: %s: %s\n", path, E.statusmsg);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// gram -b script files...: apply script to each file with no terminal, one worker per CPU
+int editorBatch(char *script, int nfiles, char **files) {
+  int count;
+  struct batchCmd *cmds = editorBatchParse(script, &count);
+  E.batch.active = 1;
+  initEditor();
+
+  struct batchStats *st = mmap(NULL, sizeof(*st), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (st == MAP_FAILED) die("mmap");
+  memset(st, 0, sizeof(*st));
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  int workers = ncpu < 1 ? 1 : ncpu > nfiles ? nfiles : ncpu;
+
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (int w = 0; w < workers; w++) {
+    pid_t pid = fork();
+    if (pid == -1) die("fork");
+    if (pid > 0) continue;
+    // Workers take the next file until there are none left, so big files don't hold up a queue
+    int i;
+    while ((i = __sync_fetch_and_add(&st->next, 1)) < nfiles) {
+      struct stat fst;
+      long long size = stat(files[i], &fst) == 0 ? fst.st_size : 0;
+      if (editorBatchFile(files[i], cmds, count) == -1) {
+        __sync_fetch_and_add(&st->failed, 1);
+      } else {
+        __sync_fetch_and_add(&st->done, 1);
+        __sync_fetch_and_add(&st->bytes, size);
+      }
+    }
+    _exit(0);
+  }
+  int status, crashed = 0;
+  while (wait(&status) > 0) {
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) crashed = 1;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+
+  double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+  if (secs <= 0) secs = 1e-9;
+  fprintf(stderr, "gram: %d files edited, %d failed in %.3f s with %d workers: %.1f files/s, %.1f MB/s\n",
+    st->done, st->failed, secs, workers, st->done / secs, st->bytes / secs / (1024.0 * 1024.0));
+  return (st->failed || crashed) ? 1 : 0;
 }
 
 /*** init ***/
@@ -1157,24 +7818,112 @@ void initEditor() {
   E.numrows = 0;
   E.row = NULL;
   E.dirty = 0;
+  E.mod_row = 0;
+  E.mod_col = 0;
   E.filename = NULL;
+  E.disk_valid = 0;
+  E.crlf = 0;
+  E.encoding = ENC_UTF8;
+  E.bom = 0;
+  E.doc_hash = 0;
+  E.saved_valid = 0;
   E.statusmsg[0] = '\0';
   E.statusmsg_time = 0;
   E.syntax = NULL;
-
-  if (getWindowSize(&E.screenrows, &E.screencols) == -1) die ("getWindowSize");
+  E.save.active = 0;
+  E.save.buf = NULL;
+  E.save.path = NULL;
+  E.save.ext = NULL;
+  E.save.srcfd = -1;
+  pthread_mutex_init(&E.save.lock, NULL);
+  E.journal.running = 0;
+  E.journal.replaying = 0;
+  E.journal.fd = -1;
+  E.journal.path = NULL;
+  E.journal.buf = NULL;
+  E.journal.cap = 0;
+  pthread_mutex_init(&E.journal.lock, NULL);
+  pthread_cond_init(&E.journal.cond, NULL);
+  E.follow.active = 0;
+  E.follow.fd = -1;
+  E.follow.wd = -1;
+  memset(&E.follow.lines, 0, sizeof(E.follow.lines));
+  E.stream.active = 0;
+  E.stream.loading = 0;
+  E.stream.async = 0;
+  memset(&E.stream.lines, 0, sizeof(E.stream.lines));
+  E.follow.lines.off = -1;
+  E.busy = 0;
+  E.readonly = 0;
+  E.hex.active = 0;
+  E.diff.active = 0;
+  E.csv.delim = 0;
+  E.csv.header = 1;
+  E.csv.ncols = 0;
+  E.csv.width = NULL;
+  E.csv.start = NULL;
+  E.csv.line = NULL;
+  E.csv.hl = NULL;
+  E.csv.linecap = 0;
+  E.watch.ifd = -1;
+  E.watch.wd = -1;
+  E.watch.name = NULL;
+  E.watch.pending = 0;
+  E.watch.conflict = 0;
+  memset(&E.undo, 0, sizeof(E.undo));
+  E.undo.fd = -1;
+  memset(&E.cursors, 0, sizeof(E.cursors));
+  memset(&E.kill, 0, sizeof(E.kill));
+  E.folds.root = NULL;
+  E.folds.seed = 2463534242u;
+  memset(&E.marks, 0, sizeof(E.marks));
+  memset(&E.stats, 0, sizeof(E.stats));
+  memset(&E.edit, 0, sizeof(E.edit));
+  E.stats.seed = 3735928559u;
+  E.marks.seed = 88172645u;
+  E.kill.yank = -1;
+  E.sel.active = 0;
+
+  // Scripts still page around, so give them a standard terminal's worth of rows
+  if (E.batch.active) {
+    E.screenrows = 24;
+    E.screencols = 80;
+  } else if (getWindowSize(&E.screenrows, &E.screencols) == -1) die ("getWindowSize");
   E.screenrows -= 2;
 }
 
 int main(int argc, char *argv[]) {
+  if (argc >= 3 && !strcmp(argv[1], "-b")) return editorBatch(argv[2], argc - 3, &argv[3]);
+
+  // Piped input takes over stdin, so keys have to come from the terminal itself
+  int streamfd = -1;
+  struct stat st;
+  if (argc >= 2 && !strcmp(argv[1], "-")) {
+    streamfd = dup(STDIN_FILENO);
+  } else if (argc >= 2 && strcmp(argv[1], "-f") && strcmp(argv[1], "-d") && stat(argv[1], &st) == 0 &&
+      !S_ISREG(st.st_mode)) {
+    streamfd = open(argv[1], O_RDONLY);
+    if (streamfd == -1) die("open");
+  }
+  if (streamfd != -1 && !isatty(STDIN_FILENO)) {
+    int tty = open("/dev/tty", O_RDWR);
+    if (tty == -1 || dup2(tty, STDIN_FILENO) == -1) die("/dev/tty");
+    close(tty);
+  }
+
   enableRawMode();
   initEditor();
-  if (argc >= 2) {
+  editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find | Ctrl-R = reload");
+  if (streamfd != -1) {
+    editorStreamOpen(streamfd, !strcmp(argv[1], "-") ? "stdin" : argv[1], 0);
+  } else if (argc >= 3 && !strcmp(argv[1], "-f")) {
+    editorFollowOpen(argv[2]);
+  } else if (argc >= 4 && !strcmp(argv[1], "-d")) {
+    editorDiffOpen(argv[2], argv[3]);
+  } else if (argc >= 2) {
     editorOpen(argv[1]);
   }
 
-  editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
-
   while (1) {
     editorRefreshScreen();
     editorProcessKeypress();